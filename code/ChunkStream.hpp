@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads the chunks of a DataFile front to back on a background thread
+// At most depth chunks are resident at a time: the reader stalls until a consumer releases
+// a chunk, so memory stays at depth x chunk_size values however large the file is, and the
+// read of the next chunks overlaps with whatever the consumers do with the current ones.
+// Any number of threads may call next() and release() concurrently.
+class ChunkStream {
+public:
+    struct Chunk {
+        size_t id;
+        std::span<const uint32_t> values;
+        // Buffer the chunk was read into, handed back by release()
+        size_t slot;
+    };
+
+    ChunkStream(const std::string& fileName, size_t depth) : fileName(fileName), file(fileName, std::ios::binary) {
+        uint64_t header[2];
+        if (!file || !file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            std::cerr << "Failed to open file: " << fileName << std::endl;
+            exit(2);
+        }
+        num_chunks = header[0];
+        chunk_size = header[1];
+        buffers.resize(std::max<size_t>(depth, 1));
+        for (size_t slot = 0; slot != buffers.size(); slot++) {
+            free_slots.push_back(slot);
+        }
+        reader = std::thread([this] { read_chunks(); });
+    }
+
+    ~ChunkStream() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        slot_freed.notify_all();
+        reader.join();
+    }
+
+    ChunkStream(const ChunkStream&) = delete;
+    ChunkStream& operator=(const ChunkStream&) = delete;
+
+    uint64_t size() const {
+        return num_chunks;
+    }
+
+    uint64_t chunk_values() const {
+        return chunk_size;
+    }
+
+    // Next chunk in file order, blocks until it was read; nullopt once every chunk was handed out
+    std::optional<Chunk> next() {
+        std::unique_lock lock(mutex);
+        chunk_read.wait(lock, [this] { return !ready.empty() || chunks_read == num_chunks; });
+        if (ready.empty()) {
+            return std::nullopt;
+        }
+        const Chunk chunk = ready.front();
+        ready.pop_front();
+        return chunk;
+    }
+
+    // Hand a chunk's buffer back to the reader; its values must not be used afterwards
+    void release(const Chunk& chunk) {
+        {
+            std::lock_guard lock(mutex);
+            free_slots.push_back(chunk.slot);
+        }
+        slot_freed.notify_one();
+    }
+
+private:
+    void read_chunks() {
+        for (size_t id = 0; id != num_chunks; id++) {
+            size_t slot;
+            {
+                std::unique_lock lock(mutex);
+                slot_freed.wait(lock, [this] { return stopping || !free_slots.empty(); });
+                if (stopping) {
+                    return;
+                }
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            // Buffers are only touched by the reader while they sit outside both lists
+            auto& buffer = buffers[slot];
+            buffer.resize(chunk_size);
+            if (!file.read(reinterpret_cast<char*>(buffer.data()), chunk_size * sizeof(uint32_t))) {
+                std::cerr << "Failed to read file: " << fileName << std::endl;
+                exit(3);
+            }
+            {
+                std::lock_guard lock(mutex);
+                ready.push_back({id, buffer, slot});
+                chunks_read++;
+            }
+            chunk_read.notify_all();
+        }
+    }
+
+    std::string fileName;
+    std::ifstream file;
+    uint64_t num_chunks = 0;
+    uint64_t chunk_size = 0;
+
+    std::vector<std::vector<uint32_t>> buffers;
+    std::vector<size_t> free_slots;
+    std::deque<Chunk> ready;
+    size_t chunks_read = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable chunk_read;
+    std::condition_variable slot_freed;
+    std::thread reader;
+};
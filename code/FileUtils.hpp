@@ -1,8 +1,19 @@
 #pragma once
 
 #include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAS_MMAP 1
+#endif
+
 struct DataFile {
     uint64_t num_chunks;
     uint64_t chunk_size;
@@ -52,3 +63,65 @@ public:
         return buffer.size();
     }
 };
+
+#ifdef HAS_MMAP
+// Read-only memory mapping of a whole file, a zero-copy replacement for InMemoryFile
+// Pages are faulted in on first touch, so only the accessed part of the file is ever loaded
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+
+public:
+    explicit MappedFile(const std::string& fileName) {
+        const int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open file: " << fileName << std::endl;
+            exit(2);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::cerr << "Failed to read file: " << fileName << std::endl;
+            exit(3);
+        }
+        length = st.st_size;
+
+        if (length != 0) {
+            void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                std::cerr << "Failed to map file: " << fileName << std::endl;
+                exit(3);
+            }
+            // Chunks are consumed front to back, so ask for aggressive read-ahead
+            madvise(mapping, length, MADV_SEQUENTIAL);
+            madvise(mapping, length, MADV_WILLNEED);
+            data = static_cast<const char*>(mapping);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<char*>(data), length);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* begin() const {
+        return data;
+    }
+
+    const char* end() const {
+        return data + length;
+    }
+
+    uintptr_t size() const {
+        return length;
+    }
+};
+#else
+using MappedFile = InMemoryFile;
+#endif
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FileUtils.hpp"
+
+// Per-chunk indexes persisted in one file, so repeated runs over a dataset skip the build
+// Layout: [magic][key][num_indexes][offsets, num_indexes + 1 of them][index bytes], all
+// header fields are uint64_t. Index i spans [offsets[i], offsets[i + 1]) of the index bytes
+// and is handed out as a view into the mapping, without copying it into a vector.
+class IndexStore {
+public:
+    static constexpr uint64_t kMagic = 0x3130455254535849ull; // "IXSTRE01"
+
+    // Map path and check it was written for key and num_indexes, nullopt if it was not
+    static std::optional<IndexStore> open(const std::string& path, uint64_t key, size_t num_indexes) {
+        IndexStore store;
+        if (!store.map(path)) {
+            return std::nullopt;
+        }
+        const size_t header_words = 4 + num_indexes;
+        if (store.length < header_words * sizeof(uint64_t) || store.header(0) != kMagic ||
+            store.header(1) != key || store.header(2) != num_indexes) {
+            return std::nullopt;
+        }
+        const size_t payload_bytes = store.length - header_words * sizeof(uint64_t);
+        for (size_t i = 0; i != num_indexes; i++) {
+            if (store.header(3 + i) > store.header(4 + i)) {
+                return std::nullopt;
+            }
+        }
+        if (store.header(3) != 0 || store.header(3 + num_indexes) != payload_bytes) {
+            return std::nullopt;
+        }
+        store.payload = store.data + header_words * sizeof(uint64_t);
+        store.num_indexes = num_indexes;
+        return store;
+    }
+
+    // Write indexes under key; goes through a temporary file so readers never see a partial store
+    static bool write(const std::string& path, uint64_t key, const std::vector<std::vector<std::byte>>& indexes) {
+        std::vector<uint64_t> header = {kMagic, key, indexes.size(), 0};
+        for (const auto& index : indexes) {
+            header.push_back(header.back() + index.size());
+        }
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(header.data()), header.size() * sizeof(uint64_t));
+            for (const auto& index : indexes) {
+                file.write(reinterpret_cast<const char*>(index.data()), index.size());
+            }
+            if (!file.flush()) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+    IndexStore(IndexStore&& other) noexcept { *this = std::move(other); }
+
+    IndexStore& operator=(IndexStore&& other) noexcept {
+        std::swap(data, other.data);
+        std::swap(length, other.length);
+        std::swap(payload, other.payload);
+        std::swap(num_indexes, other.num_indexes);
+        buffer.swap(other.buffer);
+        return *this;
+    }
+
+    ~IndexStore() {
+#ifdef HAS_MMAP
+        if (data && buffer.empty()) {
+            munmap(const_cast<char*>(data), length);
+        }
+#endif
+    }
+
+    size_t size() const {
+        return num_indexes;
+    }
+
+    std::span<const std::byte> operator[](size_t i) const {
+        const uint64_t begin = header(3 + i);
+        return {reinterpret_cast<const std::byte*>(payload) + begin, static_cast<size_t>(header(4 + i) - begin)};
+    }
+
+private:
+    IndexStore() = default;
+
+    uint64_t header(size_t word) const {
+        uint64_t value;
+        std::memcpy(&value, data + word * sizeof(uint64_t), sizeof(value));
+        return value;
+    }
+
+    bool map(const std::string& path) {
+#ifdef HAS_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(mapping);
+        length = st.st_size;
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file || file.tellg() <= 0) {
+            return false;
+        }
+        buffer.resize(file.tellg());
+        file.seekg(0, std::ios::beg);
+        if (!file.read(buffer.data(), buffer.size())) {
+            return false;
+        }
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+#endif
+    }
+
+    const char* data = nullptr;
+    size_t length = 0;
+    const char* payload = nullptr;
+    size_t num_indexes = 0;
+    // Backing storage where files cannot be mapped
+    std::vector<char> buffer;
+};
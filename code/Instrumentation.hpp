@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HAS_PERF_EVENTS 1
+#endif
+
+// Hardware counters of the whole process, threads spawned after construction included
+// Every counter is opened on its own, so a counter the kernel or the sandbox refuses only
+// drops out of the report instead of disabling the others.
+class PerfCounters {
+public:
+    static constexpr size_t kNumCounters = 3;
+    static constexpr std::array<const char*, kNumCounters> kNames = {"cycles", "branch_misses", "llc_misses"};
+
+    using Sample = std::array<std::optional<uint64_t>, kNumCounters>;
+
+    PerfCounters() {
+        fds.fill(-1);
+#ifdef HAS_PERF_EVENTS
+        const std::array<std::pair<uint32_t, uint64_t>, kNumCounters> events = {{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        }};
+        for (size_t i = 0; i != kNumCounters; i++) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef HAS_PERF_EVENTS
+        for (const int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Current counter values, unset for counters that could not be opened
+    Sample read() const {
+        Sample sample;
+#ifdef HAS_PERF_EVENTS
+        for (size_t i = 0; i != kNumCounters; i++) {
+            uint64_t value = 0;
+            if (fds[i] >= 0 && ::read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+                sample[i] = value;
+            }
+        }
+#endif
+        return sample;
+    }
+
+private:
+    std::array<int, kNumCounters> fds;
+};
+
+// Wall time, throughput and counter deltas of consecutive harness phases
+class PhaseRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Phase {
+        std::string name;
+        double seconds = 0.0;
+        // Work done in the phase, reported as <unit>_per_s
+        double units = 0.0;
+        std::string unit;
+        PerfCounters::Sample counters;
+    };
+
+    // counters may be null; phases then carry wall time only
+    explicit PhaseRecorder(const PerfCounters* counters) : counters(counters) {}
+
+    void start() {
+        started = Clock::now();
+        if (counters) {
+            start_sample = counters->read();
+        }
+    }
+
+    void stop(std::string name, double units, std::string unit) {
+        Phase phase;
+        phase.seconds = std::chrono::duration<double>(Clock::now() - started).count();
+        phase.name = std::move(name);
+        phase.units = units;
+        phase.unit = std::move(unit);
+        if (counters) {
+            const auto end_sample = counters->read();
+            for (size_t i = 0; i != PerfCounters::kNumCounters; i++) {
+                if (start_sample[i] && end_sample[i]) {
+                    phase.counters[i] = *end_sample[i] - *start_sample[i];
+                }
+            }
+        }
+        phases.push_back(std::move(phase));
+    }
+
+    const std::vector<Phase>& recorded() const {
+        return phases;
+    }
+
+private:
+    const PerfCounters* counters;
+    Clock::time_point started;
+    PerfCounters::Sample start_sample;
+    std::vector<Phase> phases;
+};
+
+// Nearest-rank percentile of an ascending sequence, 0 if it is empty
+template <class T>
+double percentile(const std::vector<T>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t rank = std::min(sorted.size() - 1, static_cast<size_t>(fraction * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[rank]);
+}
+
+// {"count", "min", "p50", "p90", "p99", "p999", "max", "mean"} of values, which are sorted in place
+template <class T>
+void write_distribution(std::ostream& out, std::vector<T>& values) {
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (const auto& value : values) {
+        sum += static_cast<double>(value);
+    }
+    out << "{\"count\": " << values.size()
+        << ", \"min\": " << percentile(values, 0.0)
+        << ", \"p50\": " << percentile(values, 0.5)
+        << ", \"p90\": " << percentile(values, 0.9)
+        << ", \"p99\": " << percentile(values, 0.99)
+        << ", \"p999\": " << percentile(values, 0.999)
+        << ", \"max\": " << (values.empty() ? 0.0 : static_cast<double>(values.back()))
+        << ", \"mean\": " << (values.empty() ? 0.0 : sum / static_cast<double>(values.size())) << "}";
+}
+
+// "phases": [...] member of the instrumentation report, counters that are unavailable print as null
+inline void write_phases(std::ostream& out, const PhaseRecorder& recorder) {
+    out << "\"phases\": [";
+    bool first = true;
+    for (const auto& phase : recorder.recorded()) {
+        out << (first ? "\n" : ",\n") << "    {\"name\": \"" << phase.name << "\""
+            << ", \"seconds\": " << phase.seconds
+            << ", \"" << phase.unit << "\": " << phase.units
+            << ", \"" << phase.unit << "_per_s\": " << (phase.seconds > 0.0 ? phase.units / phase.seconds : 0.0);
+        for (size_t i = 0; i != PerfCounters::kNumCounters; i++) {
+            out << ", \"" << PerfCounters::kNames[i] << "\": ";
+            if (phase.counters[i]) {
+                out << *phase.counters[i];
+            } else {
+                out << "null";
+            }
+        }
+        out << "}";
+        first = false;
+    }
+    out << "\n  ]";
+}
@@ -1,5 +1,48 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What the query workload looks like, so index construction can price entries by actual use
+struct WorkloadProfile {
+    static constexpr size_t kSketchDepth = 4;
+    static constexpr size_t kSketchWidthBits = 11;
+
+    // queries probed against every block
+    double num_queries;
+    // count-min sketch of predicate frequencies, empty if only the query count is known
+    std::vector<uint32_t> sketch;
+
+    explicit WorkloadProfile(double num_queries) : num_queries(num_queries) {}
+
+    void add(uint32_t predicate) {
+        sketch.resize(kSketchDepth << kSketchWidthBits);
+        for (size_t row = 0; row != kSketchDepth; row++) {
+            sketch[slot(row, predicate)]++;
+        }
+    }
+
+    // Upper bound on how often predicate is queried
+    uint32_t estimate(uint32_t predicate) const {
+        uint32_t count = UINT32_MAX;
+        for (size_t row = 0; row != kSketchDepth; row++) {
+            count = std::min(count, sketch[slot(row, predicate)]);
+        }
+        return count;
+    }
+
+private:
+    static size_t slot(size_t row, uint32_t predicate) {
+        constexpr std::array<uint64_t, kSketchDepth> multipliers = {
+            0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+        return (row << kSketchWidthBits) + ((predicate * multipliers[row]) >> (64 - kSketchWidthBits));
+    }
+};
+
 struct Parameters {
     // score increase per necessary access
     size_t f_a;
@@ -7,7 +50,9 @@ struct Parameters {
     size_t f_s;
     // name of the data/query pair used for evaluation
     std::string filename;
+    // optional workload profile, shared so copies of the parameters stay cheap
+    std::shared_ptr<const WorkloadProfile> workload;
 
     Parameters(char* arg1, char* arg2, char* arg3) : 
         f_a(atoi(arg1)), f_s(atoi(arg2)), filename(arg3){}
-};
\ No newline at end of file
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "FileUtils.hpp"
+
+// Inverted postings of the query values: for every distinct predicate, the chunks that
+// contain it and how often, as varint(chunk gap) varint(count - 1) pairs.
+// Built with one pass over the data, so a query's non-zero chunks are read in O(hits)
+// and every other chunk is known to hold the predicate 0 times.
+class QueryPostings {
+public:
+    using Posting = std::pair<size_t, size_t>;
+
+    QueryPostings(const DataFile* data, const QueryFile* queries) {
+        predicates.assign(queries->values, queries->values + queries->num_queries);
+        std::sort(predicates.begin(), predicates.end());
+        predicates.erase(std::unique(predicates.begin(), predicates.end()), predicates.end());
+        build_slots();
+
+        std::vector<std::vector<Posting>> postings(predicates.size());
+        std::vector<size_t> counts(predicates.size());
+        std::vector<size_t> touched;
+        for (size_t j = 0; j != data->num_chunks; j++) {
+            for (const uint32_t value : data->getChunk(j)) {
+                const size_t p = find(value);
+                if (p != kNotFound && counts[p]++ == 0) {
+                    touched.push_back(p);
+                }
+            }
+            for (const size_t p : touched) {
+                postings[p].emplace_back(j, counts[p]);
+                counts[p] = 0;
+            }
+            touched.clear();
+        }
+
+        offsets.reserve(predicates.size() + 1);
+        for (const auto& list : postings) {
+            offsets.push_back(bytes.size());
+            size_t prev_chunk = 0;
+            for (const auto& [chunk, count] : list) {
+                put_varint(chunk - prev_chunk);
+                put_varint(count - 1);
+                prev_chunk = chunk;
+            }
+        }
+        offsets.push_back(bytes.size());
+    }
+
+    // Decode the (chunk, count) postings of predicate in chunk order into out
+    void lookup(uint32_t predicate, std::vector<Posting>& out) const {
+        out.clear();
+        const size_t p = find(predicate);
+        if (p == kNotFound) {
+            return;
+        }
+        size_t offset = offsets[p];
+        size_t chunk = 0;
+        while (offset != offsets[p + 1]) {
+            chunk += get_varint(offset);
+            out.emplace_back(chunk, get_varint(offset) + 1);
+        }
+    }
+
+    size_t size_bytes() const {
+        return bytes.size() + offsets.size() * sizeof(size_t) + predicates.size() * sizeof(uint32_t) +
+               slots.size() * sizeof(size_t);
+    }
+
+private:
+    static constexpr size_t kNotFound = SIZE_MAX;
+
+    // Open-addressing table from a value to its position in predicates, at most half full, so the
+    // one pass over the data costs a hash and about one probe per value
+    void build_slots() {
+        size_t num_slots = 16;
+        while (num_slots < 2 * predicates.size()) {
+            num_slots *= 2;
+        }
+        slots.assign(num_slots, kNotFound);
+        for (size_t p = 0; p != predicates.size(); p++) {
+            size_t slot = home_slot(predicates[p]);
+            while (slots[slot] != kNotFound) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = p;
+        }
+    }
+
+    size_t home_slot(uint32_t value) const {
+        return static_cast<size_t>((value * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
+    }
+
+    // Position of value in predicates, kNotFound if it is not a query value
+    size_t find(uint32_t value) const {
+        for (size_t slot = home_slot(value);; slot = (slot + 1) & (slots.size() - 1)) {
+            const size_t p = slots[slot];
+            if (p == kNotFound || predicates[p] == value) {
+                return p;
+            }
+        }
+    }
+
+    void put_varint(size_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(value));
+    }
+
+    size_t get_varint(size_t& offset) const {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            const uint8_t byte = bytes[offset++];
+            value |= static_cast<size_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+    }
+
+    std::vector<uint32_t> predicates;
+    std::vector<size_t> slots;
+    std::vector<size_t> offsets;
+    std::vector<uint8_t> bytes;
+};
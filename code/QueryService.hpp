@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+// Building blocks of the query service mode: a queue of predicate batches, a memo of
+// (predicate, block) counts, and coroutines that fan a batch out over the thread pool.
+
+// Batch of predicates whose COUNT(*) over all blocks is requested together
+struct ServiceRequest {
+    size_t id;
+    std::vector<uint32_t> predicates;
+    std::chrono::steady_clock::time_point enqueued;
+};
+
+// Bounded multi-producer, multi-consumer queue of requests; pop returns nullopt once closed and drained
+class RequestQueue {
+public:
+    explicit RequestQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(ServiceRequest request) {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [this] { return requests.size() < capacity; });
+        requests.push_back(std::move(request));
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    std::optional<ServiceRequest> pop() {
+        std::unique_lock lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !requests.empty(); });
+        if (requests.empty()) {
+            return std::nullopt;
+        }
+        ServiceRequest request = std::move(requests.front());
+        requests.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return request;
+    }
+
+    void close() {
+        {
+            std::lock_guard lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<ServiceRequest> requests;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+// Four-way set-associative memo of per-block counts, split into shards that each own their cache lines
+// Slots are seqlocks: a writer that finds a slot busy drops its insert instead of waiting, and a
+// reader that sees a write in progress counts a miss, so neither side ever blocks.
+class ResultCache {
+public:
+    static constexpr size_t kShards = 16;
+    static constexpr size_t kWays = 4;
+
+    // slots_per_shard is rounded up to a power of two of at least kWays
+    explicit ResultCache(size_t slots_per_shard) {
+        size_t slots = kWays;
+        while (slots < slots_per_shard) {
+            slots *= 2;
+        }
+        for (auto& shard : shards) {
+            shard.slots = std::vector<Slot>(slots);
+        }
+    }
+
+    std::optional<size_t> find(uint32_t predicate, uint32_t block) {
+        const uint64_t key = make_key(predicate, block);
+        Shard& shard = shard_of(key);
+        const size_t set = set_of(shard, key);
+        for (size_t way = 0; way != kWays; way++) {
+            if (const auto value = read(shard.slots[set + way], key)) {
+                shard.hits.fetch_add(1, std::memory_order_relaxed);
+                return value;
+            }
+        }
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    // Takes the way already holding key (a concurrent miss may have inserted it) or a free way,
+    // and otherwise evicts the last way, so the first keys of a set stay put
+    void insert(uint32_t predicate, uint32_t block, size_t count) {
+        const uint64_t key = make_key(predicate, block);
+        Shard& shard = shard_of(key);
+        const size_t set = set_of(shard, key);
+        size_t way = 0;
+        while (way + 1 != kWays) {
+            const uint64_t stored_key = shard.slots[set + way].key.load(std::memory_order_relaxed);
+            if (stored_key == key || stored_key == kEmptyKey) {
+                break;
+            }
+            way++;
+        }
+        Slot& slot = shard.slots[set + way];
+        uint32_t version = slot.version.load(std::memory_order_relaxed);
+        if (version % 2 != 0 || !slot.version.compare_exchange_strong(version, version + 1, std::memory_order_acq_rel)) {
+            return;
+        }
+        // Orders the odd version before the payload stores, so a reader that sees either new
+        // payload word also sees the write in progress on its second version load
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.key.store(key, std::memory_order_relaxed);
+        slot.value.store(count, std::memory_order_relaxed);
+        slot.version.store(version + 2, std::memory_order_release);
+    }
+
+    size_t hits() const {
+        size_t total = 0;
+        for (const auto& shard : shards) {
+            total += shard.hits.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    size_t misses() const {
+        size_t total = 0;
+        for (const auto& shard : shards) {
+            total += shard.misses.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    // Block ids stay below 2^32 - 1, so the all-ones key never matches a lookup
+    static constexpr uint64_t kEmptyKey = UINT64_MAX;
+
+    struct Slot {
+        std::atomic<uint32_t> version{0};
+        std::atomic<uint64_t> key{kEmptyKey};
+        std::atomic<uint64_t> value{0};
+    };
+
+    struct alignas(64) Shard {
+        std::vector<Slot> slots;
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+    };
+
+    static uint64_t make_key(uint32_t predicate, uint32_t block) {
+        return static_cast<uint64_t>(block) << 32 | predicate;
+    }
+
+    // Murmur3 finalizer: the top bits pick the shard, the low bits the set
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    Shard& shard_of(uint64_t key) {
+        return shards[hash(key) >> 60];
+    }
+
+    // First slot of the key's set of kWays adjacent slots
+    static size_t set_of(const Shard& shard, uint64_t key) {
+        return hash(key) & (shard.slots.size() - kWays);
+    }
+
+    // Value stored for key in slot, nullopt if the slot holds another key or is being written
+    static std::optional<size_t> read(const Slot& slot, uint64_t key) {
+        const uint32_t version = slot.version.load(std::memory_order_acquire);
+        const uint64_t stored_key = slot.key.load(std::memory_order_relaxed);
+        const uint64_t value = slot.value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version % 2 != 0 || stored_key != key || slot.version.load(std::memory_order_relaxed) != version) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    static_assert(kShards == 16, "shard_of takes the top four hash bits");
+    std::array<Shard, kShards> shards;
+};
+
+// Fire-and-forget coroutine: starts eagerly and frees its frame when it returns
+struct ServiceTask {
+    struct promise_type {
+        ServiceTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// co_await fan_out(pool, n, f) runs f(i, worker_id) for every i in [0, n) as posted pool tasks and
+// resumes the awaiting coroutine on the worker that finishes last; the caller's thread is free meanwhile
+template <class F>
+class FanOut {
+public:
+    FanOut(ThreadPool& pool, size_t n, F& f) : pool(pool), n(n), f(f), remaining(n) {}
+
+    bool await_ready() const noexcept {
+        return n == 0;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        // The last task may resume and finish the coroutine, destroying this awaiter, before the
+        // loop ends, so the loop only reads copies
+        ThreadPool& target = pool;
+        const size_t count = n;
+        for (size_t i = 0; i != count; i++) {
+            target.post([this, handle, i](size_t worker_id) {
+                f(i, worker_id);
+                if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    handle.resume();
+                }
+            });
+        }
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    ThreadPool& pool;
+    size_t n;
+    F& f;
+    std::atomic<size_t> remaining;
+};
+
+template <class F>
+FanOut<F> fan_out(ThreadPool& pool, size_t n, F& f) {
+    return FanOut<F>(pool, n, f);
+}
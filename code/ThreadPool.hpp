@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing pool
+// Every worker owns a task deque, pops from its back and steals from the front
+// of the other deques once its own runs dry. Tasks receive the id of the worker
+// executing them, so callers can keep per-thread state without locking.
+class ThreadPool {
+public:
+    using Task = std::function<void(size_t)>;
+
+    explicit ThreadPool(size_t num_threads) : queues(num_threads) {
+        workers.reserve(num_threads);
+        for (size_t i = 0; i != num_threads; i++) {
+            workers.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Run f(i, worker_id) for every i in [0, n) and block until all calls returned
+    // Only one parallel_for may be in flight at a time
+    template <class F>
+    void parallel_for(size_t n, F&& f) {
+        if (n == 0) {
+            return;
+        }
+        pending.store(n);
+        {
+            std::lock_guard lock(mutex);
+            queued += n;
+            for (size_t i = 0; i != n; i++) {
+                auto& queue = queues[i % queues.size()];
+                std::lock_guard queue_lock(queue.mutex);
+                queue.tasks.emplace_back([this, &f, i](size_t worker_id) {
+                    f(i, worker_id);
+                    if (pending.fetch_sub(1) == 1) {
+                        std::lock_guard done_lock(done_mutex);
+                        done.notify_all();
+                    }
+                });
+            }
+        }
+        wakeup.notify_all();
+
+        std::unique_lock lock(done_mutex);
+        done.wait(lock, [this] { return pending.load() == 0; });
+    }
+
+    // Queue task without waiting for it; may be called from any thread, workers included
+    // Posted tasks go to the front of a deque, so its owner, which pops from the back, runs them
+    // oldest first and a stream of posts cannot starve the earliest ones
+    void post(Task task) {
+        {
+            std::lock_guard lock(mutex);
+            queued++;
+            auto& queue = queues[next_queue++ % queues.size()];
+            std::lock_guard queue_lock(queue.mutex);
+            queue.tasks.push_front(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(size_t worker_id, Task& task) {
+        auto& queue = queues[worker_id];
+        std::lock_guard lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t worker_id, Task& task) {
+        for (size_t i = 1; i != queues.size(); i++) {
+            auto& queue = queues[(worker_id + i) % queues.size()];
+            std::lock_guard lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t worker_id) {
+        while (true) {
+            Task task;
+            if (pop(worker_id, task) || steal(worker_id, task)) {
+                queued--;
+                task(worker_id);
+                continue;
+            }
+
+            std::unique_lock lock(mutex);
+            wakeup.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+
+    // Number of tasks sitting in the deques; raised before the tasks are pushed
+    std::atomic<ptrdiff_t> queued = 0;
+    std::atomic<size_t> pending = 0;
+    // Round-robin target of post, guarded by mutex
+    size_t next_queue = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::mutex done_mutex;
+    std::condition_variable done;
+};
@@ -1,11 +1,94 @@
 #include <optional>
 #include <vector>
 #include <span>
-#include <unordered_map>
+#include <array>
 #include <algorithm>
+#include <cstring>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <atomic>
+#include <unordered_map>
+#include <utility>
 
 #include "Parameters.hpp"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define USER_SIMD_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define USER_SIMD_NEON 1
+#endif
+
+// Index kinds are tagged in the top byte of the first header word.
+// Blocks written before the tag existed store a plain num_distinct there,
+// which never reaches 2^24 for the challenge block size, so they read as Legacy.
+enum class IndexKind : uint8_t {
+    // [num_distinct(4B)][counts_offset(4B)][delta-varint values][bitmap][varint counts]
+    Legacy = 0,
+    // [kind|num_distinct(4B)][counts_offset(4B)][skip table][delta-varint values][bitmap][varint counts]([rank directory])
+    // The value codec bits select PFOR frames or Stream VByte stripes instead of varint stripes
+    Striped = 1,
+    // [kind|num_distinct(4B)][seed(4B)][8-bit binary fuse fingerprints], answers 0 or unknown only
+    Fuse8 = 2,
+    // [kind|num_distinct(4B)][seed(4B)][16-bit binary fuse fingerprints], answers 0 or unknown only
+    Fuse16 = 3,
+    // [kind|num_heavy(4B)][counts_offset(4B)][num_tail(4B)][seed(4B)][8-bit fingerprints of the tail][sorted heavy section]
+    Hybrid8 = 4,
+    // [kind|num_heavy(4B)][counts_offset(4B)][num_tail(4B)][seed(4B)][16-bit fingerprints of the tail][sorted heavy section]
+    Hybrid16 = 5,
+    // [kind(4B)][zone map(8B)], answers 0 for values in empty zones, unknown otherwise
+    Range = 6,
+    // [kind|num_distinct(4B)][count width(1B)|key width(1B)|0|0][keys - min in Eytzinger order][counts, same order]
+    Eytzinger = 7,
+    // [kind|num_distinct(4B)][levels(1B)|key width(1B)|count width(1B)|0][words per level(4B each)]
+    // [level bit arrays][rank samples][keys - min][counts], keys and counts in perfect hash slot order
+    PerfectHash = 8,
+    // [kind|num_distinct(4B)][counts_offset(4B)][num_containers(4B)][container directory][containers]
+    // [bitmap][varint counts]([rank directory]), one array, bitset or run container per 2^16 high key
+    Roaring = 9,
+};
+// Kinds are numbered densely from 0, IndexFormat has a specialization for each of them
+constexpr size_t kNumIndexKinds = 10;
+
+constexpr uint32_t kKindShift = 24;
+constexpr uint32_t kDistinctMask = (1u << kKindShift) - 1;
+
+// The rank directory is appended after the counts section and flagged in the kind byte
+constexpr uint8_t kRankFlag = 0x80;
+// A [min(4B)][max(4B)] trailer closes the index so out-of-range probes are answered in O(1)
+constexpr uint8_t kRangeFlag = 0x40;
+// Two bits of the kind byte select the codec of a sorted section's values
+enum class ValueCodec : uint8_t {
+    Varint = 0,
+    StreamVByte = 1,
+    Pfor = 2,
+};
+constexpr uint8_t kCodecShift = 4;
+constexpr uint8_t kCodecMask = 0x30;
+constexpr uint8_t kKindMask = 0x0F;
+static_assert(kNumIndexKinds <= kKindMask + 1u, "kinds must fit the kind bits");
+constexpr size_t kRangeTrailerBytes = 8;
+
+// Number of equal-width value buckets in the zone map of a Range index
+constexpr uint64_t kZoneBuckets = 64;
+
+// Number of sorted values covered by one skip table entry
+constexpr size_t kSkipStride = 64;
+// Skip table entry: absolute head value (4B) + byte offset of the following deltas (4B)
+constexpr size_t kSkipEntryBytes = 8;
+
+inline uint32_t load_u32(const std::byte* input) {
+    uint32_t value;
+    std::memcpy(&value, input, sizeof(uint32_t));
+    return value;
+}
+
+inline void store_u32(std::byte* output, uint32_t value) {
+    std::memcpy(output, &value, sizeof(uint32_t));
+}
+
 // Encode a uint32_t as a variable-length integer (varint)
 // Returns the number of bytes written
 inline size_t encode_varint(uint32_t value, std::byte* output) {
@@ -31,178 +114,2900 @@ inline uint32_t decode_varint(const std::byte* input, size_t& offset) {
     return value;
 }
 
-// Build a compressed frequency index from input data
-// Index format: [num_distinct(4B)][counts_offset(4B)][delta-varint values][bitmap][varint counts]
-// Returns empty vector if index is not cost-effective
-std::vector<std::byte> build_idx(std::span<const uint32_t> data, Parameters config){
-    // Count frequency of each distinct value
-    std::unordered_map<uint32_t, uint32_t> freq_map;
-    for (const auto val : data) {
-        freq_map[val]++;
+// Count how often predicate occurs in values
+inline size_t count_equal_scalar(const uint32_t* values, size_t n, uint32_t predicate) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i++) {
+        result += values[i] == predicate;
     }
+    return result;
+}
 
-    const size_t num_distinct = freq_map.size();
-    const double cost_ratio = static_cast<double>(config.f_a) / static_cast<double>(config.f_s);
+#ifdef USER_SIMD_X86
+__attribute__((target("avx2")))
+inline size_t count_equal_avx2(const uint32_t* values, size_t n, uint32_t predicate) {
+    const __m256i needle = _mm256_set1_epi32(static_cast<int>(predicate));
+    // Matching lanes compare to -1, so subtracting the mask counts them per lane
+    __m256i lane_counts = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+        lane_counts = _mm256_sub_epi32(lane_counts, _mm256_cmpeq_epi32(block, needle));
+    }
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), lane_counts);
+    size_t result = 0;
+    for (const auto lane : lanes) {
+        result += lane;
+    }
+    return result + count_equal_scalar(values + i, n - i, predicate);
+}
 
-    constexpr double estimated_queries_per_block = 550.0;
+__attribute__((target("avx512f")))
+inline size_t count_equal_avx512(const uint32_t* values, size_t n, uint32_t predicate) {
+    const __m512i needle = _mm512_set1_epi32(static_cast<int>(predicate));
+    size_t result = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512i block = _mm512_loadu_si512(values + i);
+        result += std::popcount(static_cast<uint32_t>(_mm512_cmpeq_epi32_mask(block, needle)));
+    }
+    if (i < n) {
+        const auto tail_mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+        const __m512i block = _mm512_maskz_loadu_epi32(tail_mask, values + i);
+        result += std::popcount(static_cast<uint32_t>(_mm512_mask_cmpeq_epi32_mask(tail_mask, block, needle)));
+    }
+    return result;
+}
+#endif
 
-    // Sort values for delta encoding
-    std::vector<std::pair<uint32_t, uint32_t>> items;
-    items.reserve(num_distinct);
-    for (const auto& [value, count] : freq_map) {
-        items.emplace_back(value, count);
+#ifdef USER_SIMD_NEON
+inline size_t count_equal_neon(const uint32_t* values, size_t n, uint32_t predicate) {
+    const uint32x4_t needle = vdupq_n_u32(predicate);
+    uint32x4_t lane_counts = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // Matching lanes compare to all ones, so subtracting the mask counts them per lane
+        lane_counts = vsubq_u32(lane_counts, vceqq_u32(vld1q_u32(values + i), needle));
     }
-    std::ranges::sort(items,
-                      [](const auto& a, const auto& b) { return a.first < b.first; });
-    
-    std::vector<std::byte> index;
-    index.reserve(8 + num_distinct * 3);
-
-    // Header: [num_distinct(4B)][counts_offset(4B) - filled later]
-    const auto num_distinct_u32 = static_cast<uint32_t>(num_distinct);
-    index.resize(8);
-    std::memcpy(index.data(), &num_distinct_u32, sizeof(uint32_t));
-    size_t offset = 8;
-    
-    // Encode values section using delta encoding with varint compression
-    // First value is stored directly, subsequent values store delta from previous
-    uint32_t prev_value = 0;
-    for (size_t i = 0; i < items.size(); i++) {
-        uint32_t value = items[i].first;
-        
-        if (i == 0) {
-            std::byte varint_buf[5];
-            size_t varint_len = encode_varint(value, varint_buf);
-            index.resize(offset + varint_len);
-            std::memcpy(index.data() + offset, varint_buf, varint_len);
-            offset += varint_len;
-        } else {
-            uint32_t delta = value - prev_value;
-            std::byte varint_buf[5];
-            size_t varint_len = encode_varint(delta, varint_buf);
-            index.resize(offset + varint_len);
-            std::memcpy(index.data() + offset, varint_buf, varint_len);
-            offset += varint_len;
-        }
-        prev_value = value;
-    }
-    
-    // Encode counts section using bitmap + varint compression
-    // Bitmap: 1 bit per value (1 = count is 1, 0 = count stored in varint section)
-    // Varint section: only stores counts >= 2 as (count - 2)
-    const auto counts_offset = static_cast<uint32_t>(offset);
-    std::memcpy(index.data() + 4, &counts_offset, sizeof(uint32_t));
-    
-    // Allocate and initialize bitmap
-    size_t bitmap_bytes = (num_distinct + 7) / 8;
-    index.resize(offset + bitmap_bytes);
-    std::memset(index.data() + offset, 0, bitmap_bytes);
-    size_t bitmap_offset = offset;
-    offset += bitmap_bytes;
-    
-    // Encode counts: count=1 sets bitmap bit, count>=2 stores (count-2) as varint
-    for (size_t i = 0; i < items.size(); i++) {
-        if (const uint32_t count = items[i].second; count == 1) {
-            size_t byte_idx = i / 8;
-            const size_t bit_idx = i % 8;
-            index[bitmap_offset + byte_idx] = static_cast<std::byte>(
-                static_cast<uint32_t>(index[bitmap_offset + byte_idx]) | (1 << bit_idx)
-            );
-        } else {
-            std::byte varint_buf[5];
-            const size_t varint_len = encode_varint(count - 2, varint_buf);
-            index.resize(offset + varint_len);
-            std::memcpy(index.data() + offset, varint_buf, varint_len);
-            offset += varint_len;
+    return vaddvq_u32(lane_counts) + count_equal_scalar(values + i, n - i, predicate);
+}
+#endif
+
+using CountEqualFn = size_t (*)(const uint32_t*, size_t, uint32_t);
+
+// Pick the widest kernel the running CPU supports
+inline CountEqualFn select_count_equal() {
+#if defined(USER_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return count_equal_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return count_equal_avx2;
+    }
+#elif defined(USER_SIMD_NEON)
+    return count_equal_neon;
+#endif
+    return count_equal_scalar;
+}
+
+// Count how often predicate occurs in values, dispatched once to the best available kernel
+inline size_t count_equal(std::span<const uint32_t> values, uint32_t predicate) {
+    static const CountEqualFn kernel = select_count_equal();
+    return kernel(values.data(), values.size(), predicate);
+}
+
+// Number of bitmap bits covered by one rank directory entry
+constexpr size_t kRankBlockBits = 512;
+// Rank directory entry: byte offset of the first count varint of the superblock (4B)
+constexpr size_t kRankEntryBytes = 4;
+constexpr uint64_t kVarintStopBits = 0x8080808080808080ull;
+
+inline size_t rank_directory_entries(size_t num_indexed) {
+    return num_indexed > kRankBlockBits ? (num_indexed - 1) / kRankBlockBits : 0;
+}
+
+// Size of the index without its range trailer
+inline size_t payload_size(std::span<const std::byte> index) {
+    return (static_cast<uint8_t>(index[3]) & kRangeFlag) != 0 ? index.size() - kRangeTrailerBytes : index.size();
+}
+
+// Zone map bucket of value within [min, max]
+inline size_t zone_bucket(uint32_t value, uint32_t min, uint32_t max) {
+    return static_cast<size_t>((static_cast<uint64_t>(value - min) * kZoneBuckets) / (static_cast<uint64_t>(max - min) + 1));
+}
+
+// Load up to 8 bytes as a little-endian word, zero-padding past end
+inline uint64_t load_word(const std::byte* input, const std::byte* end) {
+    uint64_t word = 0;
+    std::memcpy(&word, input, std::min<size_t>(sizeof(uint64_t), end - input));
+    return word;
+}
+
+// Skip num_varints varints starting at offset of data, 8 bytes at a time, reading nothing past end
+// Every byte without the continuation bit terminates one varint
+inline size_t skip_varints(const std::byte* data, const std::byte* end, size_t offset, size_t num_varints) {
+    while (num_varints > 0) {
+        uint64_t stops = ~load_word(data + offset, end) & kVarintStopBits;
+        const auto num_stops = static_cast<size_t>(std::popcount(stops));
+        if (num_stops < num_varints) {
+            num_varints -= num_stops;
+            offset += sizeof(uint64_t);
+            continue;
+        }
+        for (; num_varints > 1; num_varints--) {
+            stops &= stops - 1;
         }
+        return offset + std::countr_zero(stops) / 8 + 1;
+    }
+    return offset;
+}
+
+// Skip varints of a block index, which end where its range trailer starts
+inline size_t skip_varints(std::span<const std::byte> index, size_t offset, size_t num_varints) {
+    return skip_varints(index.data(), index.data() + payload_size(index), offset, num_varints);
+}
+
+// Decode the count of the value at position found_idx from the counts section
+// Counts section: [bitmap (1 = count is 1)][varint (count - 2) for every 0 bit][rank directory]
+// Without a rank directory the whole bitmap forms a single superblock
+inline size_t lookup_count(std::span<const std::byte> index, size_t counts_offset,
+                           size_t num_indexed, size_t found_idx, bool has_rank_directory) {
+    const size_t bitmap_bytes = (num_indexed + 7) / 8;
+    const std::byte* bitmap = index.data() + counts_offset;
+    const std::byte* bitmap_end = bitmap + bitmap_bytes;
+
+    // Check bitmap: if bit is set, count is 1
+    if ((static_cast<uint32_t>(bitmap[found_idx / 8]) & (1 << (found_idx % 8))) != 0) {
+        return 1;
     }
 
-    // Cost-benefit analysis: skip index if it's not cost-effective
-    const auto actual_size_bytes = static_cast<double>(index.size());
+    // Land on the superblock, then count the non-one entries before found_idx in it
+    size_t superblock = 0;
+    size_t varint_offset = counts_offset + bitmap_bytes;
+    if (has_rank_directory && found_idx >= kRankBlockBits) {
+        superblock = found_idx / kRankBlockBits;
+        const size_t directory_offset = payload_size(index) - rank_directory_entries(num_indexed) * kRankEntryBytes;
+        varint_offset = load_u32(index.data() + directory_offset + (superblock - 1) * kRankEntryBytes);
+    }
 
-    if (const double break_even_bytes = estimated_queries_per_block * cost_ratio * 1024.0; actual_size_bytes > break_even_bytes) {
-        return {};  // Index too large, not worth the storage cost
+    size_t non_ones_before = 0;
+    for (size_t bit = superblock * kRankBlockBits; bit < found_idx; bit += 64) {
+        uint64_t zeros = ~load_word(bitmap + bit / 8, bitmap_end);
+        if (found_idx - bit < 64) {
+            zeros &= (uint64_t{1} << (found_idx - bit)) - 1;
+        }
+        non_ones_before += std::popcount(zeros);
     }
-    
-    return index;
+
+    // Decode the count (stored as count-2, so add 2 back)
+    varint_offset = skip_varints(index, varint_offset, non_ones_before);
+    const uint32_t count_minus_2 = decode_varint(index.data(), varint_offset);
+    return count_minus_2 + 2;
 }
 
-// Query the frequency of a value in the index
-// Returns std::nullopt if no index, 0 if value not found, otherwise the count
-std::optional<size_t> query_idx(uint32_t predicate, const std::vector<std::byte>& index){
-    if (index.empty()) {
+// Sort values with an LSD radix sort over 8-bit digits, using scratch as the ping-pong buffer
+// Digits shared by all values are skipped, so narrow value ranges take fewer passes
+inline void radix_sort(std::vector<uint32_t>& values, std::vector<uint32_t>& scratch) {
+    constexpr size_t kRadix = 256;
+    const size_t n = values.size();
+    if (n < 2) {
+        return;
+    }
+    scratch.resize(n);
+
+    // Histogram all four digits in a single pass
+    std::array<std::array<uint32_t, kRadix>, 4> histograms{};
+    for (const auto val : values) {
+        histograms[0][val & 0xFF]++;
+        histograms[1][(val >> 8) & 0xFF]++;
+        histograms[2][(val >> 16) & 0xFF]++;
+        histograms[3][val >> 24]++;
+    }
+
+    for (size_t digit = 0; digit < 4; digit++) {
+        auto& histogram = histograms[digit];
+        const size_t shift = digit * 8;
+        if (histogram[(values[0] >> shift) & 0xFF] == n) {
+            continue;
+        }
+
+        uint32_t position = 0;
+        for (auto& bucket : histogram) {
+            const uint32_t bucket_size = bucket;
+            bucket = position;
+            position += bucket_size;
+        }
+        for (const auto val : values) {
+            scratch[histogram[(val >> shift) & 0xFF]++] = val;
+        }
+        values.swap(scratch);
+    }
+}
+
+// Collapse sorted values into (value, count) pairs
+inline void run_length_count(std::span<const uint32_t> sorted, std::vector<std::pair<uint32_t, uint32_t>>& items) {
+    items.clear();
+    for (size_t i = 0; i < sorted.size();) {
+        size_t run_end = i + 1;
+        while (run_end < sorted.size() && sorted[run_end] == sorted[i]) {
+            run_end++;
+        }
+        items.emplace_back(sorted[i], static_cast<uint32_t>(run_end - i));
+        i = run_end;
+    }
+}
+
+// Visit the slots of the Eytzinger (BFS) layout of n sorted entries in sorted order
+// Slots are 1-based, so the children of slot k are 2k and 2k + 1; visit(slot, rank) is
+// called with rank counting up from the rank passed for slot k's subtree
+template <class Visit>
+inline size_t eytzinger_visit(size_t n, size_t k, size_t rank, Visit&& visit) {
+    if (k <= n) {
+        rank = eytzinger_visit(n, 2 * k, rank, visit);
+        visit(k, rank++);
+        rank = eytzinger_visit(n, 2 * k + 1, rank, visit);
+    }
+    return rank;
+}
+
+// Slot of the lower bound reached by an Eytzinger descent that ended at k, 0 if every value is smaller
+inline size_t eytzinger_lower_bound_slot(size_t k) {
+    // Strip the trailing right turns
+    return k >> (std::countr_one(k) + 1);
+}
+
+// Binary fuse filter (Graf and Lemire) over the distinct values of a block
+// Every key maps to three slots in consecutive segments whose fingerprints XOR to its own.
+// A probe that fails this check is definitely absent; an absent probe passes it with
+// probability 2^-bits, so a positive probe can only be answered by scanning.
+constexpr size_t kFuseHeaderBytes = 8;
+constexpr uint32_t kFuseMaxAttempts = 64;
+// Hybrid header: [kind|num_heavy(4B)][counts_offset(4B)][num_tail(4B)][seed(4B)]
+constexpr size_t kHybridHeaderBytes = 16;
+
+// Murmur3 finalizer, a bijection on 64-bit words, so distinct keys never share a hash
+inline uint64_t mix_hash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t fuse_hash(uint32_t key, uint32_t seed) {
+    return mix_hash((static_cast<uint64_t>(seed) << 32) | key);
+}
+
+// High 64 bits of hash * range for a 32-bit range, without 128-bit integers
+inline uint64_t mul_high(uint64_t hash, uint32_t range) {
+    const uint64_t low = ((hash & 0xFFFFFFFFull) * range) >> 32;
+    return ((hash >> 32) * range + low) >> 32;
+}
+
+// Filter geometry, derived from the number of keys alone so it need not be stored
+struct BinaryFuseShape {
+    uint32_t segment_length;
+    uint32_t segment_count_length;
+    uint32_t array_length;
+
+    explicit BinaryFuseShape(size_t num_keys) {
+        segment_length = num_keys == 0 ? 4 :
+            1u << static_cast<int>(std::floor(std::log(static_cast<double>(num_keys)) / std::log(3.33) + 2.25));
+        segment_length = std::min<uint32_t>(segment_length, 1u << 18);
+        const double size_factor = num_keys <= 1 ? 0.0 :
+            std::max(1.125, 0.875 + 0.25 * std::log(1000000.0) / std::log(static_cast<double>(num_keys)));
+        const auto capacity = static_cast<uint32_t>(std::round(static_cast<double>(num_keys) * size_factor));
+        const uint32_t num_segments = (capacity + segment_length - 1) / segment_length;
+        const uint32_t segment_count = num_segments > 3 ? num_segments - 2 : 1;
+        segment_count_length = segment_count * segment_length;
+        array_length = (segment_count + 2) * segment_length;
+    }
+
+    std::array<uint32_t, 3> positions(uint64_t hash) const {
+        const auto h0 = static_cast<uint32_t>(mul_high(hash, segment_count_length));
+        const uint32_t h1 = (h0 + segment_length) ^ (static_cast<uint32_t>(hash >> 18) & (segment_length - 1));
+        const uint32_t h2 = (h0 + 2 * segment_length) ^ (static_cast<uint32_t>(hash) & (segment_length - 1));
+        return {h0, h1, h2};
+    }
+};
+
+template <class Fingerprint>
+inline Fingerprint fuse_fingerprint(uint64_t hash) {
+    return static_cast<Fingerprint>(hash ^ (hash >> 32));
+}
+
+// Builds binary fuse fingerprints by hypergraph peeling, reusing its scratch across blocks
+class BinaryFuseBuilder {
+public:
+    // Write shape.array_length fingerprints for the distinct keys to output
+    // Returns the seed that peeled successfully, or nullopt if every attempt failed
+    template <class Fingerprint>
+    std::optional<uint32_t> build(std::span<const uint32_t> keys, const BinaryFuseShape& shape, std::byte* output) {
+        for (uint32_t seed = 0; seed != kFuseMaxAttempts; seed++) {
+            if (peel(keys, shape, seed)) {
+                assign<Fingerprint>(shape, output);
+                return seed;
+            }
+        }
         return std::nullopt;
     }
-    
-    // Read header
-    uint32_t num_indexed;
-    uint32_t counts_offset;
-    std::memcpy(&num_indexed, index.data(), sizeof(uint32_t));
-    std::memcpy(&counts_offset, index.data() + 4, sizeof(uint32_t));
-    
-    // Decode delta-encoded values to find the predicate
-    size_t value_offset = 8;
-    uint32_t current_value = 0;
-    int found_idx = -1;
-    
-    for (uint32_t i = 0; i < num_indexed; i++) {
-        if (i == 0) {
-            current_value = decode_varint(index.data(), value_offset);
-        } else {
-            uint32_t delta = decode_varint(index.data(), value_offset);
-            current_value += delta;
+
+private:
+    // Repeatedly remove slots hit by exactly one key, recording the order in stack
+    bool peel(std::span<const uint32_t> keys, const BinaryFuseShape& shape, uint32_t seed) {
+        // Per slot: number of keys << 2 | XOR of the key's hash index (0..2) at that slot
+        slot_counts.assign(shape.array_length, 0);
+        slot_hashes.assign(shape.array_length, 0);
+        for (const auto key : keys) {
+            const uint64_t hash = fuse_hash(key, seed);
+            const auto slots = shape.positions(hash);
+            for (uint32_t j = 0; j < 3; j++) {
+                slot_counts[slots[j]] = (slot_counts[slots[j]] + 4) ^ j;
+                slot_hashes[slots[j]] ^= hash;
+            }
         }
-        
-        if (current_value == predicate) {
-            found_idx = i;
-            break;
+
+        queue.clear();
+        for (uint32_t i = 0; i < shape.array_length; i++) {
+            if (slot_counts[i] >> 2 == 1) {
+                queue.push_back(i);
+            }
         }
-        
-        // Values are sorted, so we can early exit
-        if (current_value > predicate) {
-            return 0;
+
+        stack.clear();
+        while (!queue.empty()) {
+            const uint32_t slot = queue.back();
+            queue.pop_back();
+            if (slot_counts[slot] >> 2 != 1) {
+                continue;
+            }
+            const uint64_t hash = slot_hashes[slot];
+            const uint32_t found = slot_counts[slot] & 3;
+            slot_counts[slot] = 0;
+            stack.emplace_back(hash, found);
+
+            const auto slots = shape.positions(hash);
+            for (uint32_t j = 0; j < 3; j++) {
+                if (j == found) {
+                    continue;
+                }
+                slot_counts[slots[j]] = (slot_counts[slots[j]] - 4) ^ j;
+                slot_hashes[slots[j]] ^= hash;
+                if (slot_counts[slots[j]] >> 2 == 1) {
+                    queue.push_back(slots[j]);
+                }
+            }
         }
+        return stack.size() == keys.size();
     }
-    
-    if (found_idx < 0) {
-        return 0;
+
+    // Walk the peeling order backwards so every key's free slot is set last
+    template <class Fingerprint>
+    void assign(const BinaryFuseShape& shape, std::byte* output) {
+        fingerprints.assign(shape.array_length, 0);
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+            const auto [hash, found] = *it;
+            const auto slots = shape.positions(hash);
+            fingerprints[slots[found]] = fuse_fingerprint<Fingerprint>(hash) ^
+                                         fingerprints[slots[(found + 1) % 3]] ^
+                                         fingerprints[slots[(found + 2) % 3]];
+        }
+        for (uint32_t i = 0; i < shape.array_length; i++) {
+            const auto fingerprint = static_cast<Fingerprint>(fingerprints[i]);
+            std::memcpy(output + i * sizeof(Fingerprint), &fingerprint, sizeof(Fingerprint));
+        }
     }
 
-    // Decode the count for the found value
-    const size_t bitmap_bytes = (num_indexed + 7) / 8;
-    const size_t bitmap_offset = counts_offset;
-    size_t varint_offset = counts_offset + bitmap_bytes;
-    
-    size_t byte_idx = found_idx / 8;
-    size_t bit_idx = found_idx % 8;
+    std::vector<uint32_t> slot_counts;
+    std::vector<uint64_t> slot_hashes;
+    std::vector<uint32_t> queue;
+    std::vector<std::pair<uint64_t, uint32_t>> stack;
+    std::vector<uint16_t> fingerprints;
+};
 
-    // Check bitmap: if bit is set, count is 1
-    bool is_one = (static_cast<uint32_t>(index[bitmap_offset + byte_idx]) & (1 << bit_idx)) != 0;
-    if (is_one) {
-        return 1;
+// Minimal perfect hash (BBHash, Limasset et al.) over the distinct values of a block
+// Level l is a bit array of kPhfGamma bits per key left; keys that land alone on a bit set it,
+// colliding keys move on to the next level. A key's slot is the rank of its bit across all
+// levels, found through one rank sample per kPhfRankWords words.
+constexpr double kPhfGamma = 2.0;
+constexpr size_t kPhfMaxLevels = 32;
+constexpr size_t kPhfRankWords = 8;
+constexpr size_t kPhfHeaderBytes = 8;
+
+// Roaring containers, each holding the low 16 bits of the values that share their high 16 bits
+// Array: sorted low keys (2B each). Bitset: 2^16 bits, then the popcount before every
+// kRoaringRankWords words (2B each). Run: [num_runs(2B)] and per run [start(2B)][length - 1(2B)]
+// [values in the container before the run(2B)]. A container takes whichever form is smallest.
+enum class RoaringContainer : uint8_t {
+    Array = 0,
+    Bitset = 1,
+    Run = 2,
+};
+constexpr size_t kRoaringHeaderBytes = 12;
+// Directory entry: [high key(2B)][container type(1B)][0(1B)][container offset(4B)][values before it(4B)]
+constexpr size_t kRoaringEntryBytes = 12;
+constexpr size_t kRoaringBitsetWords = 1024;
+constexpr size_t kRoaringRankWords = 8;
+constexpr size_t kRoaringBitsetBytes = kRoaringBitsetWords * sizeof(uint64_t) + kRoaringBitsetWords / kRoaringRankWords * 2;
+constexpr size_t kRoaringRunBytes = 6;
+
+// Slot of key, or nullopt if it is on no level and so definitely absent
+// Keys that were not hashed may still reach a slot; the stored key there tells them apart
+inline std::optional<size_t> perfect_hash_slot(uint32_t key, const std::byte* level_words, size_t num_levels,
+                                               const std::byte* bits, const std::byte* ranks) {
+    size_t level_base = 0;
+    for (size_t level = 0; level < num_levels; level++) {
+        const uint32_t num_words = load_u32(level_words + level * sizeof(uint32_t));
+        const uint64_t bit = mul_high(fuse_hash(key, static_cast<uint32_t>(level)), num_words * 64);
+        const size_t word_index = level_base + bit / 64;
+        uint64_t word;
+        std::memcpy(&word, bits + word_index * sizeof(uint64_t), sizeof(uint64_t));
+        if ((word >> (bit % 64) & 1) != 0) {
+            size_t rank = load_u32(ranks + word_index / kPhfRankWords * sizeof(uint32_t));
+            for (size_t w = word_index / kPhfRankWords * kPhfRankWords; w < word_index; w++) {
+                uint64_t before;
+                std::memcpy(&before, bits + w * sizeof(uint64_t), sizeof(uint64_t));
+                rank += std::popcount(before);
+            }
+            return rank + std::popcount(word & ((uint64_t{1} << (bit % 64)) - 1));
+        }
+        level_base += num_words;
     }
-    
-    // Count how many non-one entries appear before this index
-    // to find the correct position in the varint section
-    size_t non_ones_before = 0;
-    for (int i = 0; i < found_idx; i++) {
-        byte_idx = i / 8;
-        bit_idx = i % 8;
-        bool is_one_i = (static_cast<uint32_t>(index[bitmap_offset + byte_idx]) & (1 << bit_idx)) != 0;
-        if (!is_one_i) {
-            non_ones_before++;
+    return std::nullopt;
+}
+
+// Builds the level bit arrays of a minimal perfect hash, reusing its scratch across blocks
+class PerfectHashBuilder {
+public:
+    // Fill words with the concatenated levels and level_words with their sizes in words
+    // Returns false if keys still collide after kPhfMaxLevels levels
+    bool build(std::span<const uint32_t> keys, std::vector<uint64_t>& words, std::vector<uint32_t>& level_words) {
+        words.clear();
+        level_words.clear();
+        remaining.assign(keys.begin(), keys.end());
+
+        while (!remaining.empty()) {
+            if (level_words.size() == kPhfMaxLevels) {
+                return false;
+            }
+            const auto level = static_cast<uint32_t>(level_words.size());
+            const auto num_words = static_cast<uint32_t>(
+                std::ceil(kPhfGamma * static_cast<double>(remaining.size()) / 64.0));
+            seen.assign(num_words, 0);
+            collided.assign(num_words, 0);
+
+            for (const auto key : remaining) {
+                const uint64_t bit = mul_high(fuse_hash(key, level), num_words * 64);
+                const uint64_t mask = uint64_t{1} << (bit % 64);
+                collided[bit / 64] |= seen[bit / 64] & mask;
+                seen[bit / 64] |= mask;
+            }
+
+            size_t kept = 0;
+            for (const auto key : remaining) {
+                const uint64_t bit = mul_high(fuse_hash(key, level), num_words * 64);
+                if ((collided[bit / 64] >> (bit % 64) & 1) != 0) {
+                    remaining[kept++] = key;
+                }
+            }
+            remaining.resize(kept);
+
+            for (uint32_t w = 0; w < num_words; w++) {
+                words.push_back(seen[w] & ~collided[w]);
+            }
+            level_words.push_back(num_words);
         }
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> remaining;
+    std::vector<uint64_t> seen;
+    std::vector<uint64_t> collided;
+};
+
+// Worst-case encoded size of a uint32_t varint
+constexpr size_t kMaxVarintBytes = 5;
+
+using Item = std::pair<uint32_t, uint32_t>;
+
+// Number of sorted values per PFOR frame; the head value lives in the frame table
+constexpr size_t kPforFrame = 128;
+// Deltas packed in a full frame, one for every value after the head
+constexpr size_t kPforFrameDeltas = kPforFrame - 1;
+// PFOR frame table entry: absolute head value (4B) + byte offset of the frame (4B)
+constexpr size_t kPforEntryBytes = 8;
+// Frame header: [bit width(1B)][num exceptions(1B)]
+constexpr size_t kPforFrameHeaderBytes = 2;
+
+inline size_t varint_bytes(uint64_t value) {
+    return std::max<size_t>(1, (std::bit_width(value) + 6) / 7);
+}
+
+// Bit width minimizing the size of a frame: packed low bits plus patched exceptions,
+// each exception costs a position byte and a varint of the bits above the width
+inline uint8_t pfor_width(std::span<const uint32_t> deltas) {
+    std::array<size_t, 33> num_with_width{};
+    for (const auto delta : deltas) {
+        num_with_width[std::bit_width(delta)]++;
     }
-    
-    // Skip over the varints before our target
-    for (size_t i = 0; i < non_ones_before; i++) {
-        while ((static_cast<uint32_t>(index[varint_offset]) & 0x80) != 0) {
-            varint_offset++;
+    size_t best_bytes = SIZE_MAX;
+    uint8_t best_width = 32;
+    for (uint8_t width = 0; width <= 32; width++) {
+        size_t bytes = (deltas.size() * width + 7) / 8;
+        for (size_t bits = width + 1; bits <= 32; bits++) {
+            bytes += num_with_width[bits] * (1 + varint_bytes(uint64_t{1} << (bits - width - 1)));
+        }
+        if (bytes < best_bytes) {
+            best_bytes = bytes;
+            best_width = width;
         }
-        varint_offset++;
     }
+    return best_width;
+}
 
-    // Decode the count (stored as count-2, so add 2 back)
-    const uint32_t count_minus_2 = decode_varint(index.data(), varint_offset);
-    return count_minus_2 + 2;
+// Encode sorted values as PFOR frames: [frame table][frames]
+// Frame: [bit width(1B)][num exceptions(1B)][deltas packed at bit width][exceptions: position(1B) + varint(delta >> width)]
+// section is written from its start, offsets in the frame table are relative to the index (section_offset)
+// Returns the end offset
+inline size_t encode_pfor_values(std::span<const Item> entries, std::byte* section, size_t section_offset) {
+    const size_t num_frames = (entries.size() + kPforFrame - 1) / kPforFrame;
+    size_t offset = num_frames * kPforEntryBytes;
+
+    std::array<uint32_t, kPforFrameDeltas> deltas;
+    for (size_t frame = 0; frame < num_frames; frame++) {
+        const size_t first = frame * kPforFrame;
+        const size_t num_deltas = std::min(kPforFrame, entries.size() - first) - 1;
+        store_u32(section + frame * kPforEntryBytes, entries[first].first);
+        store_u32(section + frame * kPforEntryBytes + 4, static_cast<uint32_t>(section_offset + offset));
+
+        for (size_t k = 0; k < num_deltas; k++) {
+            deltas[k] = entries[first + k + 1].first - entries[first + k].first;
+        }
+        const uint8_t width = pfor_width({deltas.data(), num_deltas});
+        const uint64_t mask = (uint64_t{1} << width) - 1;
+
+        std::byte* frame_header = section + offset;
+        frame_header[0] = static_cast<std::byte>(width);
+        offset += kPforFrameHeaderBytes;
+
+        const size_t packed_bytes = (num_deltas * width + 7) / 8;
+        std::memset(section + offset, 0, packed_bytes);
+        for (size_t k = 0; k < num_deltas; k++) {
+            const size_t bit = k * width;
+            for (uint64_t bits = (deltas[k] & mask) << (bit % 8), i = bit / 8; bits != 0; bits >>= 8, i++) {
+                section[offset + i] |= static_cast<std::byte>(bits & 0xFF);
+            }
+        }
+        offset += packed_bytes;
+
+        uint8_t num_exceptions = 0;
+        for (size_t k = 0; k < num_deltas; k++) {
+            if (const uint64_t high = static_cast<uint64_t>(deltas[k]) >> width; high != 0) {
+                section[offset++] = static_cast<std::byte>(k);
+                offset += encode_varint(static_cast<uint32_t>(high), section + offset);
+                num_exceptions++;
+            }
+        }
+        frame_header[1] = static_cast<std::byte>(num_exceptions);
+    }
+    return section_offset + offset;
+}
+
+// Stream VByte stripes share the skip table layout of varint stripes: [skip table][stripes]
+// Stripe: [control bytes, 2 bits per delta = byte length - 1][delta bytes, little endian]
+inline size_t encode_svb_values(std::span<const Item> entries, std::byte* section, size_t section_offset) {
+    const size_t num_stripes = (entries.size() + kSkipStride - 1) / kSkipStride;
+    size_t offset = num_stripes * kSkipEntryBytes;
+
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        const size_t first = stripe * kSkipStride;
+        const size_t num_deltas = std::min(kSkipStride, entries.size() - first) - 1;
+        store_u32(section + stripe * kSkipEntryBytes, entries[first].first);
+        store_u32(section + stripe * kSkipEntryBytes + 4, static_cast<uint32_t>(section_offset + offset));
+
+        std::byte* control = section + offset;
+        const size_t control_bytes = (num_deltas + 3) / 4;
+        std::memset(control, 0, control_bytes);
+        offset += control_bytes;
+        for (size_t k = 0; k < num_deltas; k++) {
+            const uint32_t delta = entries[first + k + 1].first - entries[first + k].first;
+            const size_t length = std::max<size_t>(1, (std::bit_width(delta) + 7) / 8);
+            control[k / 4] |= static_cast<std::byte>((length - 1) << (2 * (k % 4)));
+            std::memcpy(section + offset, &delta, length);
+            offset += length;
+        }
+    }
+    return section_offset + offset;
+}
+
+// Worst-case size of a Stream VByte value section
+inline size_t svb_values_bound(size_t num_entries) {
+    const size_t num_stripes = (num_entries + kSkipStride - 1) / kSkipStride;
+    return num_stripes * (kSkipEntryBytes + kSkipStride / 4) + num_entries * sizeof(uint32_t);
+}
+
+// Worst-case size of a PFOR value section
+inline size_t pfor_values_bound(size_t num_entries) {
+    const size_t num_frames = (num_entries + kPforFrame - 1) / kPforFrame;
+    return num_frames * (kPforEntryBytes + kPforFrameHeaderBytes + kPforFrame * sizeof(uint32_t));
+}
+
+// Expected workload of a block, in the units of the score function
+// Probes split into misses (predicate absent from the block) and hits,
+// which are assumed to be distributed like the values of the block.
+struct CostModel {
+    double f_a;
+    double f_s;
+    double probes;
+    double miss_fraction;
+    // Expected probes for one value, unset without a predicate sketch
+    std::function<double(uint32_t)> value_probes;
+
+    // Without a workload profile in the parameters, a fixed guess of the workload is priced
+    // The profile is looked up structurally, so the model also builds against parameters without one
+    template <class Config>
+    explicit CostModel(const Config& config) :
+        f_a(static_cast<double>(config.f_a)), f_s(static_cast<double>(config.f_s)) {
+        constexpr double estimated_queries_per_block = 550.0;
+        constexpr double estimated_absent_fraction = 0.5;
+        probes = estimated_queries_per_block;
+        miss_fraction = estimated_absent_fraction;
+        if constexpr (requires { config.workload->num_queries; config.workload->estimate(0u); }) {
+            if (const auto workload = config.workload) {
+                probes = workload->num_queries;
+                if (!workload->sketch.empty()) {
+                    value_probes = [workload](uint32_t value) { return static_cast<double>(workload->estimate(value)); };
+                }
+            }
+        }
+    }
+
+    // Narrow the miss fraction to the values of this block, if the sketch knows them
+    void observe(std::span<const Item> items) {
+        if (!value_probes || probes <= 0.0) {
+            return;
+        }
+        double hits = 0.0;
+        for (const auto& item : items) {
+            hits += value_probes(item.first);
+        }
+        miss_fraction = 1.0 - std::min(hits, probes) / probes;
+    }
+
+    // Expected probes that hit the value of item in a block of block_size values
+    // Without a sketch, predicates are assumed to follow the data distribution
+    double expected_hits(const Item& item, size_t block_size) const {
+        if (value_probes) {
+            return std::min(value_probes(item.first), probes);
+        }
+        return expected_hits() * static_cast<double>(item.second) / static_cast<double>(block_size);
+    }
+
+    double expected_misses() const {
+        return probes * miss_fraction;
+    }
+
+    double expected_hits() const {
+        return probes * (1.0 - miss_fraction);
+    }
+
+    // Share of misses outside [min, max], assuming absent predicates spread over the whole domain
+    static double out_of_range_fraction(uint32_t min, uint32_t max) {
+        return 1.0 - (static_cast<double>(max - min) + 1.0) / 4294967296.0;
+    }
+
+    // Share of an index's benefit that may be given up for a layout with faster lookups
+    // The score only counts accesses, so lookup speed is bought with a bounded amount of storage
+    static constexpr double kLayoutSlack = 0.002;
+
+    // Whether a faster layout of from_bytes -> to_bytes that skips as much is affordable
+    bool affords_layout(double expected_skips, size_t from_bytes, size_t to_bytes) const {
+        const double benefit = net_benefit(expected_skips, from_bytes);
+        return benefit > 0.0 && net_benefit(expected_skips, to_bytes) >= benefit * (1.0 - kLayoutSlack);
+    }
+
+    // Score gained by an index of the given size that avoids expected_skips scans
+    double net_benefit(double expected_skips, size_t bytes) const {
+        return expected_skips * f_a - static_cast<double>(bytes) / 1024.0 * f_s;
+    }
+};
+
+// Binary fuse filter over a set of keys, with the fingerprint width that pays off best
+struct FilterPlan {
+    BinaryFuseShape shape;
+    size_t fingerprint_bytes;
+
+    FilterPlan(size_t num_keys, const CostModel& model) : shape(num_keys) {
+        fingerprint_bytes = model.net_benefit(skipped_misses(sizeof(uint16_t), model), bytes(sizeof(uint16_t))) >
+                            model.net_benefit(skipped_misses(sizeof(uint8_t), model), bytes(sizeof(uint8_t)))
+                            ? sizeof(uint16_t) : sizeof(uint8_t);
+    }
+
+    size_t bytes(size_t width) const {
+        return shape.array_length * width;
+    }
+
+    size_t bytes() const {
+        return bytes(fingerprint_bytes);
+    }
+
+    // Misses the filter rules out; the false positives still have to scan
+    static double skipped_misses(size_t width, const CostModel& model) {
+        return model.expected_misses() * (1.0 - std::ldexp(1.0, -8 * static_cast<int>(width)));
+    }
+
+    double skipped_misses(const CostModel& model) const {
+        return skipped_misses(fingerprint_bytes, model);
+    }
+};
+
+// One way to index a block: the finished index and the scans it is expected to skip
+struct IndexOption {
+    double skips;
+    std::vector<std::byte> index;
+};
+
+// Reusable index builder
+// Keeps its sort and count buffers across blocks, so steady-state builds only
+// allocate the returned index. build_idx runs one builder per thread.
+class IndexBuilder {
+public:
+    // Build a compressed frequency index from input data
+    // Of the candidates (see collect_candidates), the one with the best expected net benefit is
+    // kept. A compressed exact winner is laid out as a perfect hash or Eytzinger search tree if
+    // that costs little of its benefit.
+    // Returns empty vector if no index is cost-effective
+    std::vector<std::byte> build(std::span<const uint32_t> data, const Parameters& config) {
+        last_benefit = 0.0;
+        count_values(data);
+        if (items.size() > kDistinctMask) {
+            return {};  // Does not fit the tagged header
+        }
+
+        CostModel model(config);
+        model.observe(items);
+        const auto candidates = collect_candidates(data.size(), model);
+
+        // Best candidate first, ties go to the earlier one; a candidate finish cannot emit falls
+        // back to the next best
+        std::vector<std::pair<double, size_t>> ranked;
+        for (size_t i = 0; i != candidates.size(); i++) {
+            ranked.push_back({model.net_benefit(candidates[i].skips, candidates[i].bytes), i});
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (auto [benefit, i] : ranked) {
+            if (benefit <= 0.0) {
+                break;  // Index too large, not worth the storage cost
+            }
+            if (auto index = finish(candidates[i], candidates, model, benefit); !index.empty()) {
+                last_benefit = benefit;
+                return index;
+            }
+        }
+        return {};
+    }
+
+    // Every candidate build weighs for data, finished as build would emit it, with the scans it is
+    // expected to skip under config; the multi-block allocator chooses among them per block
+    std::vector<IndexOption> options(std::span<const uint32_t> data, const Parameters& config) {
+        count_values(data);
+        if (items.size() > kDistinctMask) {
+            return {};
+        }
+        CostModel model(config);
+        model.observe(items);
+        const auto candidates = collect_candidates(data.size(), model);
+
+        std::vector<IndexOption> options;
+        for (const auto& candidate : candidates) {
+            double benefit = model.net_benefit(candidate.skips, candidate.bytes);
+            if (auto index = finish(candidate, candidates, model, benefit); !index.empty()) {
+                options.push_back({candidate.skips, std::move(index)});
+            }
+        }
+        return options;
+    }
+
+    // Build data as an index of the given kind, whatever it costs, closed with the range trailer
+    // codec picks the value codec of a Striped index's sorted section, the smallest one if unset.
+    // Returns empty vector for an empty block, for Legacy (read, never written anymore), for a
+    // Hybrid of a block whose values are all equally frequent, or if the fingerprints could not be built.
+    // Lets benchmarks and checks reach the formats that selection emits rarely or never.
+    std::vector<std::byte> build_as(std::span<const uint32_t> data, const Parameters& config, IndexKind kind,
+                                    std::optional<ValueCodec> codec = std::nullopt) {
+        count_values(data);
+        if (items.empty() || items.size() > kDistinctMask) {
+            return {};
+        }
+        CostModel model(config);
+        model.observe(items);
+
+        std::vector<std::byte> index;
+        switch (kind) {
+            case IndexKind::Legacy:
+                break;
+            case IndexKind::Striped:
+                index = build_striped(model, codec);
+                break;
+            case IndexKind::Fuse8:
+            case IndexKind::Fuse16: {
+                FilterPlan plan(items.size(), model);
+                plan.fingerprint_bytes = kind == IndexKind::Fuse16 ? sizeof(uint16_t) : sizeof(uint8_t);
+                index = build_filter(plan);
+                break;
+            }
+            case IndexKind::Hybrid8:
+            case IndexKind::Hybrid16: {
+                // Without a priced split, the most frequent values are the heavy hitters
+                size_t num_heavy = count_heavy_hitters(data.size(), build_striped(model).size(), model);
+                if (num_heavy == 0 || num_heavy == items.size()) {
+                    const auto most_frequent = std::ranges::max(items, {}, &Item::second);
+                    heavy_hit_threshold = model.expected_hits(most_frequent, data.size());
+                    num_heavy = std::ranges::count_if(items, [&](const Item& item) {
+                        return model.expected_hits(item, data.size()) >= heavy_hit_threshold;
+                    });
+                }
+                if (num_heavy != items.size()) {
+                    double hybrid_skips = 0.0;
+                    index = build_hybrid(data.size(), model, hybrid_skips,
+                                         kind == IndexKind::Hybrid16 ? sizeof(uint16_t) : sizeof(uint8_t));
+                }
+                break;
+            }
+            case IndexKind::Range: {
+                double range_skips = 0.0;
+                index = build_range(model, range_skips);
+                break;
+            }
+            case IndexKind::Eytzinger:
+                index = build_eytzinger();
+                break;
+            case IndexKind::PerfectHash:
+                index = build_perfect_hash();
+                break;
+            case IndexKind::Roaring:
+                index = build_roaring(model);
+                break;
+        }
+        if (!index.empty()) {
+            append_range(index);
+        }
+        return index;
+    }
+
+    // Expected net benefit of the index the last build returned, 0 if it returned none
+    double benefit() const {
+        return last_benefit;
+    }
+
+private:
+    // An index build weighs: the index without its range trailer, or the plan of a filter that is
+    // only built if it wins; bytes is what the candidate is priced at, range trailer included
+    struct Candidate {
+        size_t bytes;
+        double skips;
+        std::vector<std::byte> index;
+        std::optional<FilterPlan> filter;
+    };
+
+    // Candidates are the exact Striped index, a Hybrid of exact heavy hitters plus a filter
+    // over the tail, a Roaring index, a minimal perfect hash, a plain filter and a zone map, in this order
+    std::vector<Candidate> collect_candidates(size_t block_size, const CostModel& model) {
+        std::vector<Candidate> candidates;
+        auto striped = build_striped(model);
+        const size_t striped_bytes = striped.size();
+        candidates.push_back({striped_bytes + range_trailer_bytes(), model.probes, std::move(striped), std::nullopt});
+
+        if (const auto num_heavy = count_heavy_hitters(block_size, striped_bytes, model);
+            num_heavy != 0 && num_heavy != items.size()) {
+            double hybrid_skips = 0.0;
+            auto hybrid = build_hybrid(block_size, model, hybrid_skips);
+            if (!hybrid.empty()) {
+                const size_t hybrid_bytes = hybrid.size();
+                candidates.push_back({hybrid_bytes + range_trailer_bytes(), hybrid_skips, std::move(hybrid), std::nullopt});
+            }
+        }
+
+        if (auto roaring = build_roaring(model); !roaring.empty()) {
+            const size_t roaring_bytes = roaring.size();
+            candidates.push_back({roaring_bytes + range_trailer_bytes(), model.probes, std::move(roaring), std::nullopt});
+        }
+
+        if (auto perfect_hash = build_perfect_hash(); !perfect_hash.empty()) {
+            const size_t perfect_hash_bytes = perfect_hash.size();
+            candidates.push_back({perfect_hash_bytes + range_trailer_bytes(), model.probes, std::move(perfect_hash), std::nullopt});
+        }
+
+        const FilterPlan filter_plan(items.size(), model);
+        candidates.push_back({kFuseHeaderBytes + filter_plan.bytes() + range_trailer_bytes(), filter_plan.skipped_misses(model),
+                              {}, filter_plan});
+
+        if (!items.empty()) {
+            double range_skips = 0.0;
+            auto range = build_range(model, range_skips);
+            candidates.push_back({range.size() + range_trailer_bytes(), range_skips, std::move(range), std::nullopt});
+        }
+        return candidates;
+    }
+
+    // Range index: [kind(4B)][zone map(8B)]; needs a non-empty block
+    // Even without any per-value information, the value range answers out-of-range misses
+    std::vector<std::byte> build_range(const CostModel& model, double& expected_skips) const {
+        size_t empty_zones = 0;
+        const uint64_t zone_map = build_zone_map(empty_zones);
+        const double in_range = 1.0 - CostModel::out_of_range_fraction(items.front().first, items.back().first);
+        expected_skips = model.expected_misses() *
+            (1.0 - in_range + in_range * static_cast<double>(empty_zones) / static_cast<double>(kZoneBuckets));
+        std::vector<std::byte> range(12, std::byte{0});
+        store_u32(range.data(), tag(IndexKind::Range, 0));
+        std::memcpy(range.data() + 4, &zone_map, sizeof(uint64_t));
+        return range;
+    }
+
+    // Bytes the range trailer adds to every index of a non-empty block
+    size_t range_trailer_bytes() const {
+        return items.empty() ? 0 : kRangeTrailerBytes;
+    }
+
+    // Close index with the [min][max] range trailer of the block and flag it in the kind byte
+    void append_range(std::vector<std::byte>& index) const {
+        const size_t end = index.size();
+        index.resize(end + kRangeTrailerBytes);
+        store_u32(index.data() + end, items.front().first);
+        store_u32(index.data() + end + 4, items.back().first);
+        index[3] |= std::byte{kRangeFlag};
+    }
+
+    // Emit candidate: a compressed exact index is replaced by the smaller affordable O(1) or
+    // search-order layout, which updates benefit, and every non-empty block closes with its range
+    // Returns empty vector if the candidate is a filter whose construction failed on every seed
+    std::vector<std::byte> finish(const Candidate& candidate, const std::vector<Candidate>& candidates,
+                                  const CostModel& model, double& benefit) {
+        std::vector<std::byte> index = candidate.filter ? build_filter(*candidate.filter) : candidate.index;
+        if (index.empty()) {
+            return {};
+        }
+
+        if (static_cast<IndexKind>(static_cast<uint8_t>(index[3]) & kKindMask) == IndexKind::Striped) {
+            const auto perfect_hash = std::find_if(candidates.begin(), candidates.end(), [](const Candidate& other) {
+                return !other.index.empty() &&
+                    static_cast<IndexKind>(static_cast<uint8_t>(other.index[3]) & kKindMask) == IndexKind::PerfectHash;
+            });
+            const size_t striped_bytes = index.size() + range_trailer_bytes();
+            const size_t eytzinger_bytes_closed = eytzinger_bytes() + range_trailer_bytes();
+            const bool perfect_hash_fits = perfect_hash != candidates.end() &&
+                model.affords_layout(model.probes, striped_bytes, perfect_hash->bytes);
+            if (perfect_hash_fits && perfect_hash->bytes <= eytzinger_bytes_closed) {
+                index = perfect_hash->index;
+            } else if (model.affords_layout(model.probes, striped_bytes, eytzinger_bytes_closed)) {
+                index = build_eytzinger();
+            } else if (perfect_hash_fits) {
+                index = perfect_hash->index;
+            }
+            benefit = model.net_benefit(model.probes, index.size() + range_trailer_bytes());
+        }
+
+        if (!items.empty()) {
+            append_range(index);
+        }
+        index.shrink_to_fit();
+        return index;
+    }
+
+    // Exact index: [kind|num_distinct(4B)][counts_offset(4B)][sorted section]
+    std::vector<std::byte> build_striped(const CostModel& model, std::optional<ValueCodec> codec = std::nullopt) {
+        // A forced codec may be larger than the varint stripes the bound is sized for
+        const size_t codec_bytes = codec ? std::max(pfor_values_bound(items.size()), svb_values_bound(items.size())) : 0;
+        std::vector<std::byte> index(8 + sorted_section_bound(items.size()) + codec_bytes);
+        store_u32(index.data(), tag(IndexKind::Striped, items.size()));
+        const size_t end = encode_sorted(items, index.data(), 8, codec);
+        finish_sorted(index, end, model.probes, model);
+        return index;
+    }
+
+    // Count width of an Eytzinger index, the fewest bytes that hold every count
+    size_t eytzinger_count_width() const {
+        uint32_t max_count = 0;
+        for (const auto& item : items) {
+            max_count = std::max(max_count, item.second);
+        }
+        return max_count <= UINT8_MAX ? 1 : max_count <= UINT16_MAX ? 2 : 4;
+    }
+
+    // Bytes of a key stored as the offset of a value from the block minimum: 8, 16, 24 or 32 bits
+    size_t key_width() const {
+        const uint32_t range = items.empty() ? 0 : items.back().first - items.front().first;
+        return std::max<size_t>(1, (std::bit_width(range) + 7) / 8);
+    }
+
+    size_t eytzinger_bytes() const {
+        return 8 + items.size() * (key_width() + eytzinger_count_width());
+    }
+
+    // Eytzinger index: [kind|num_distinct(4B)][count width(1B)|key width(1B)|0|0][keys][counts]
+    // Keys (offsets from the min of the range trailer) and counts are stored in BFS order of the
+    // implicit search tree, both at the fewest bytes that hold every one of them
+    std::vector<std::byte> build_eytzinger() {
+        const size_t n = items.size();
+        const size_t count_width = eytzinger_count_width();
+        const size_t width = key_width();
+        std::vector<std::byte> index(eytzinger_bytes());
+        store_u32(index.data(), tag(IndexKind::Eytzinger, n));
+        store_u32(index.data() + 4, static_cast<uint32_t>(count_width | width << 8));
+        std::byte* keys = index.data() + 8;
+        std::byte* counts = keys + n * width;
+        eytzinger_visit(n, 1, 0, [&](size_t slot, size_t rank) {
+            const uint32_t key = items[rank].first - items.front().first;
+            std::memcpy(keys + (slot - 1) * width, &key, width);
+            std::memcpy(counts + (slot - 1) * count_width, &items[rank].second, count_width);
+        });
+        return index;
+    }
+
+    // Type and size of the container over entries, which share their high 16 bits
+    static std::pair<RoaringContainer, size_t> roaring_container(std::span<const Item> entries) {
+        size_t num_runs = 1;
+        for (size_t i = 1; i < entries.size(); i++) {
+            num_runs += entries[i].first != entries[i - 1].first + 1;
+        }
+        const size_t array_bytes = entries.size() * 2;
+        const size_t run_bytes = 2 + num_runs * kRoaringRunBytes;
+        if (array_bytes <= run_bytes && array_bytes <= kRoaringBitsetBytes) {
+            return {RoaringContainer::Array, array_bytes};
+        }
+        return run_bytes <= kRoaringBitsetBytes ? std::pair{RoaringContainer::Run, run_bytes}
+                                                : std::pair{RoaringContainer::Bitset, kRoaringBitsetBytes};
+    }
+
+    // Roaring index: values split by their high 16 bits into array, bitset or run containers, each
+    // a membership test that yields the value's rank; counts are stored as for a sorted section
+    std::vector<std::byte> build_roaring(const CostModel& model) {
+        if (items.empty()) {
+            return {};
+        }
+        const std::span<const Item> entries(items);
+        std::vector<size_t> bounds = {0};
+        for (size_t i = 1; i < entries.size(); i++) {
+            if (entries[i].first >> 16 != entries[i - 1].first >> 16) {
+                bounds.push_back(i);
+            }
+        }
+        bounds.push_back(entries.size());
+        const size_t num_containers = bounds.size() - 1;
+
+        size_t offset = kRoaringHeaderBytes + num_containers * kRoaringEntryBytes;
+        size_t containers_bytes = 0;
+        for (size_t c = 0; c < num_containers; c++) {
+            containers_bytes += roaring_container(entries.subspan(bounds[c], bounds[c + 1] - bounds[c])).second;
+        }
+        std::vector<std::byte> index(offset + containers_bytes + (entries.size() + 7) / 8 +
+                                     rank_directory_entries(entries.size()) * kRankEntryBytes + entries.size() * kMaxVarintBytes);
+        store_u32(index.data(), tag(IndexKind::Roaring, entries.size()));
+        store_u32(index.data() + 8, static_cast<uint32_t>(num_containers));
+
+        for (size_t c = 0; c < num_containers; c++) {
+            const auto container = entries.subspan(bounds[c], bounds[c + 1] - bounds[c]);
+            const auto [type, bytes] = roaring_container(container);
+            std::byte* entry = index.data() + kRoaringHeaderBytes + c * kRoaringEntryBytes;
+            const auto high = static_cast<uint16_t>(container.front().first >> 16);
+            std::memcpy(entry, &high, sizeof(high));
+            entry[2] = static_cast<std::byte>(type);
+            store_u32(entry + 4, static_cast<uint32_t>(offset));
+            store_u32(entry + 8, static_cast<uint32_t>(bounds[c]));
+
+            std::byte* out = index.data() + offset;
+            switch (type) {
+                case RoaringContainer::Array:
+                    for (size_t i = 0; i < container.size(); i++) {
+                        const auto low = static_cast<uint16_t>(container[i].first);
+                        std::memcpy(out + i * 2, &low, sizeof(low));
+                    }
+                    break;
+                case RoaringContainer::Bitset: {
+                    std::array<uint64_t, kRoaringBitsetWords> words{};
+                    for (const auto& item : container) {
+                        words[(item.first & 0xFFFF) / 64] |= uint64_t{1} << (item.first % 64);
+                    }
+                    std::memcpy(out, words.data(), sizeof(words));
+                    uint16_t rank = 0;
+                    for (size_t w = 0; w < kRoaringBitsetWords; w++) {
+                        if (w % kRoaringRankWords == 0) {
+                            std::memcpy(out + sizeof(words) + w / kRoaringRankWords * 2, &rank, sizeof(rank));
+                        }
+                        rank += std::popcount(words[w]);
+                    }
+                    break;
+                }
+                case RoaringContainer::Run: {
+                    uint16_t num_runs = 0;
+                    for (size_t i = 0; i < container.size();) {
+                        size_t run_end = i + 1;
+                        while (run_end < container.size() && container[run_end].first == container[run_end - 1].first + 1) {
+                            run_end++;
+                        }
+                        const std::array<uint16_t, 3> run = {static_cast<uint16_t>(container[i].first),
+                                                             static_cast<uint16_t>(run_end - i - 1), static_cast<uint16_t>(i)};
+                        std::memcpy(out + 2 + num_runs * kRoaringRunBytes, run.data(), kRoaringRunBytes);
+                        num_runs++;
+                        i = run_end;
+                    }
+                    std::memcpy(out, &num_runs, sizeof(num_runs));
+                    break;
+                }
+            }
+            offset += bytes;
+        }
+
+        const size_t end = encode_counts(entries, index.data(), offset);
+        finish_sorted(index, end, model.probes, model);
+        return index;
+    }
+
+    // Perfect hash index: a minimal perfect hash over the distinct values, then every value's key
+    // (offset from the min of the range trailer) and count at its slot; empty if the hash could not be built
+    std::vector<std::byte> build_perfect_hash() {
+        if (items.empty()) {
+            return {};
+        }
+        keys.clear();
+        for (const auto& item : items) {
+            keys.push_back(item.first);
+        }
+        if (!perfect_hash_builder.build(keys, phf_words, phf_level_words)) {
+            return {};
+        }
+
+        const size_t n = items.size();
+        const size_t key_width = this->key_width();
+        const size_t count_width = eytzinger_count_width();
+        const size_t num_levels = phf_level_words.size();
+        const size_t levels_offset = kPhfHeaderBytes;
+        const size_t bits_offset = levels_offset + num_levels * sizeof(uint32_t);
+        const size_t ranks_offset = bits_offset + phf_words.size() * sizeof(uint64_t);
+        const size_t keys_offset = ranks_offset + (phf_words.size() + kPhfRankWords - 1) / kPhfRankWords * sizeof(uint32_t);
+        const size_t counts_offset = keys_offset + n * key_width;
+
+        std::vector<std::byte> index(counts_offset + n * count_width);
+        store_u32(index.data(), tag(IndexKind::PerfectHash, n));
+        store_u32(index.data() + 4, static_cast<uint32_t>(num_levels | key_width << 8 | count_width << 16));
+        for (size_t level = 0; level < num_levels; level++) {
+            store_u32(index.data() + levels_offset + level * sizeof(uint32_t), phf_level_words[level]);
+        }
+        std::memcpy(index.data() + bits_offset, phf_words.data(), phf_words.size() * sizeof(uint64_t));
+        uint32_t rank = 0;
+        for (size_t w = 0; w < phf_words.size(); w++) {
+            if (w % kPhfRankWords == 0) {
+                store_u32(index.data() + ranks_offset + w / kPhfRankWords * sizeof(uint32_t), rank);
+            }
+            rank += std::popcount(phf_words[w]);
+        }
+
+        for (const auto& [value, count] : items) {
+            const size_t slot = *perfect_hash_slot(value, index.data() + levels_offset, num_levels,
+                                                   index.data() + bits_offset, index.data() + ranks_offset);
+            const uint32_t key = value - items.front().first;
+            std::memcpy(index.data() + keys_offset + slot * key_width, &key, key_width);
+            std::memcpy(index.data() + counts_offset + slot * count_width, &count, count_width);
+        }
+        return index;
+    }
+
+    // Hybrid index: [kind|num_heavy(4B)][counts_offset(4B)][num_tail(4B)][seed(4B)][fingerprints][sorted section]
+    // Heavy hitters are stored exactly, tail values only as filter keys (answered as unknown)
+    // fingerprint_bytes overrides the width the filter plan picks
+    std::vector<std::byte> build_hybrid(size_t block_size, const CostModel& model, double& expected_skips,
+                                        std::optional<size_t> fingerprint_bytes = std::nullopt) {
+        heavy.clear();
+        keys.clear();
+        double heavy_hits = 0.0;
+        for (const auto& item : items) {
+            if (const double hits = model.expected_hits(item, block_size); hits >= heavy_hit_threshold) {
+                heavy.push_back(item);
+                heavy_hits += hits;
+            } else {
+                keys.push_back(item.first);
+            }
+        }
+
+        FilterPlan plan(keys.size(), model);
+        plan.fingerprint_bytes = fingerprint_bytes.value_or(plan.fingerprint_bytes);
+        const size_t section_offset = kHybridHeaderBytes + plan.bytes();
+        std::vector<std::byte> index(section_offset + sorted_section_bound(heavy.size()));
+        const auto seed = build_fingerprints(plan, index.data() + kHybridHeaderBytes);
+        if (!seed) {
+            return {};
+        }
+
+        const IndexKind kind = plan.fingerprint_bytes == sizeof(uint16_t) ? IndexKind::Hybrid16 : IndexKind::Hybrid8;
+        store_u32(index.data(), tag(kind, heavy.size()));
+        store_u32(index.data() + 8, static_cast<uint32_t>(keys.size()));
+        store_u32(index.data() + 12, *seed);
+
+        expected_skips = plan.skipped_misses(model) + heavy_hits;
+        const size_t end = encode_sorted(heavy, index.data(), section_offset);
+        finish_sorted(index, end, expected_skips, model);
+        return index;
+    }
+
+    // Filter index: [kind|num_distinct(4B)][seed(4B)][fingerprints], answers 0 for definitely absent values
+    std::vector<std::byte> build_filter(const FilterPlan& plan) {
+        keys.clear();
+        for (const auto& item : items) {
+            keys.push_back(item.first);
+        }
+
+        std::vector<std::byte> index(kFuseHeaderBytes + plan.bytes());
+        const auto seed = build_fingerprints(plan, index.data() + kFuseHeaderBytes);
+        if (!seed) {
+            return {};
+        }
+        const IndexKind kind = plan.fingerprint_bytes == sizeof(uint16_t) ? IndexKind::Fuse16 : IndexKind::Fuse8;
+        store_u32(index.data(), tag(kind, items.size()));
+        store_u32(index.data() + 4, *seed);
+        return index;
+    }
+
+    // Choose the heavy hitter threshold and return how many values reach it
+    // A value is kept exact if the probes that hit it outweigh what its exact entry costs
+    // over a filter key.
+    size_t count_heavy_hitters(size_t block_size, size_t exact_bytes, const CostModel& model) {
+        if (items.empty()) {
+            return 0;
+        }
+        const FilterPlan plan(items.size(), model);
+        const double exact_bytes_per_value = static_cast<double>(exact_bytes) / static_cast<double>(items.size());
+        const double filter_bytes_per_value = static_cast<double>(plan.bytes()) / static_cast<double>(items.size());
+        const double extra_cost = (exact_bytes_per_value - filter_bytes_per_value) / 1024.0 * model.f_s;
+
+        heavy_hit_threshold = extra_cost / model.f_a;
+        return std::ranges::count_if(items, [&](const Item& item) {
+            return model.expected_hits(item, block_size) >= heavy_hit_threshold;
+        });
+    }
+
+    // One bit per equal-width bucket of [min, max] that holds at least one value
+    uint64_t build_zone_map(size_t& empty_zones) const {
+        uint64_t zone_map = 0;
+        for (const auto& item : items) {
+            zone_map |= uint64_t{1} << zone_bucket(item.first, items.front().first, items.back().first);
+        }
+        empty_zones = kZoneBuckets - std::popcount(zone_map);
+        return zone_map;
+    }
+
+    std::optional<uint32_t> build_fingerprints(const FilterPlan& plan, std::byte* output) {
+        if (plan.fingerprint_bytes == sizeof(uint16_t)) {
+            return fuse_builder.build<uint16_t>(keys, plan.shape, output);
+        }
+        return fuse_builder.build<uint8_t>(keys, plan.shape, output);
+    }
+
+    static uint32_t tag(IndexKind kind, size_t num_entries) {
+        return static_cast<uint32_t>(num_entries) | (static_cast<uint32_t>(kind) << kKindShift);
+    }
+
+    // Worst-case size of a sorted section, including its rank directory
+    static size_t sorted_section_bound(size_t num_entries) {
+        const size_t num_stripes = (num_entries + kSkipStride - 1) / kSkipStride;
+        return num_stripes * kSkipEntryBytes + (num_entries + 7) / 8 +
+               rank_directory_entries(num_entries) * kRankEntryBytes + 2 * num_entries * kMaxVarintBytes;
+    }
+
+    // Encode a sorted section at section_offset: [skip table][delta-varint values][bitmap][varint counts]
+    // The skip table holds one entry per kSkipStride sorted values; the head value of each
+    // stripe lives only in the table, the stream stores the deltas of the remaining values.
+    // If PFOR frames or Stream VByte stripes are smaller, they replace the varint stripes,
+    // recorded in the codec bits of the kind byte; a forced codec is kept whatever its size.
+    // Writes counts_offset to the second header word and returns the end of the counts.
+    size_t encode_sorted(std::span<const Item> entries, std::byte* out, size_t section_offset,
+                         std::optional<ValueCodec> forced_codec = std::nullopt) {
+        const size_t num_stripes = (entries.size() + kSkipStride - 1) / kSkipStride;
+        size_t offset = section_offset + num_stripes * kSkipEntryBytes;
+
+        // Encode values section using delta encoding with varint compression
+        // Stripe heads are stored absolute in the skip table, other values store delta from previous
+        uint32_t prev_value = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            const uint32_t value = entries[i].first;
+
+            if (i % kSkipStride == 0) {
+                std::byte* entry = out + section_offset + (i / kSkipStride) * kSkipEntryBytes;
+                store_u32(entry, value);
+                store_u32(entry + 4, static_cast<uint32_t>(offset));
+            } else {
+                offset += encode_varint(value - prev_value, out + offset);
+            }
+            prev_value = value;
+        }
+
+        // Keep PFOR frames or Stream VByte stripes instead if they are smaller
+        ValueCodec codec = ValueCodec::Varint;
+        codec_values.resize(std::max(pfor_values_bound(entries.size()), svb_values_bound(entries.size())));
+        auto keeps = [&](ValueCodec candidate, size_t end) {
+            return forced_codec ? *forced_codec == candidate : end < offset;
+        };
+        if (const size_t pfor_end = encode_pfor_values(entries, codec_values.data(), section_offset);
+            keeps(ValueCodec::Pfor, pfor_end)) {
+            std::memcpy(out + section_offset, codec_values.data(), pfor_end - section_offset);
+            offset = pfor_end;
+            codec = ValueCodec::Pfor;
+        }
+        if (const size_t svb_end = encode_svb_values(entries, codec_values.data(), section_offset);
+            keeps(ValueCodec::StreamVByte, svb_end)) {
+            std::memcpy(out + section_offset, codec_values.data(), svb_end - section_offset);
+            offset = svb_end;
+            codec = ValueCodec::StreamVByte;
+        }
+        out[3] |= static_cast<std::byte>(static_cast<uint8_t>(codec) << kCodecShift);
+        return encode_counts(entries, out, offset);
+    }
+
+    // Encode the counts of entries at offset: [bitmap][varint counts], remembering the rank directory
+    // Writes counts_offset to the second header word and returns the end of the counts.
+    size_t encode_counts(std::span<const Item> entries, std::byte* out, size_t offset) {
+        // Encode counts section using bitmap + varint compression
+        // Bitmap: 1 bit per value (1 = count is 1, 0 = count stored in varint section)
+        // Varint section: only stores counts >= 2 as (count - 2)
+        store_u32(out + 4, static_cast<uint32_t>(offset));
+        const size_t bitmap_offset = offset;
+        offset += (entries.size() + 7) / 8;
+        std::memset(out + bitmap_offset, 0, offset - bitmap_offset);
+
+        // Encode counts: count=1 sets bitmap bit, count>=2 stores (count-2) as varint
+        // Every kRankBlockBits entries, remember where the superblock's varints begin
+        rank_directory.clear();
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (i != 0 && i % kRankBlockBits == 0) {
+                rank_directory.push_back(static_cast<uint32_t>(offset));
+            }
+            if (const uint32_t count = entries[i].second; count == 1) {
+                out[bitmap_offset + i / 8] |= static_cast<std::byte>(1 << (i % 8));
+            } else {
+                offset += encode_varint(count - 2, out + offset);
+            }
+        }
+        return offset;
+    }
+
+    // Append the rank directory of the last encode_sorted and trim the index to its payload
+    // The directory only speeds up lookups, so it is appended only if the index still pays off
+    void finish_sorted(std::vector<std::byte>& index, size_t end, double expected_skips, const CostModel& model) {
+        const size_t directory_bytes = rank_directory.size() * kRankEntryBytes;
+        if (!rank_directory.empty() && model.net_benefit(expected_skips, end + directory_bytes) > 0.0) {
+            std::memcpy(index.data() + end, rank_directory.data(), directory_bytes);
+            end += directory_bytes;
+            index[3] |= std::byte{kRankFlag};
+        }
+        index.resize(end);
+    }
+
+    // Count frequency of each distinct value into items, sorted by value for delta encoding
+    // Constant blocks are recognized with one vectorized pass instead of sorting
+    void count_values(std::span<const uint32_t> data) {
+        items.clear();
+        if (!data.empty() && count_equal(data, data.front()) == data.size()) {
+            items.emplace_back(data.front(), static_cast<uint32_t>(data.size()));
+            return;
+        }
+        sorted.assign(data.begin(), data.end());
+        radix_sort(sorted, scratch);
+        run_length_count(sorted, items);
+    }
+
+    std::vector<uint32_t> sorted;
+    std::vector<uint32_t> scratch;
+    std::vector<Item> items;
+    std::vector<Item> heavy;
+    // Expected probes a value needs before it earns an exact entry in a Hybrid index
+    double heavy_hit_threshold = 0.0;
+    std::vector<uint32_t> rank_directory;
+    std::vector<uint32_t> keys;
+    std::vector<std::byte> codec_values;
+    BinaryFuseBuilder fuse_builder;
+    PerfectHashBuilder perfect_hash_builder;
+    double last_benefit = 0.0;
+    std::vector<uint64_t> phf_words;
+    std::vector<uint32_t> phf_level_words;
+};
+
+// Generation of the indexes the decoded-index caches may hold; a cache that sees a newer one drops
+// every entry, since a freshly built index can reuse the address of a freed one
+inline std::atomic<uint64_t> decoded_cache_generation{0};
+
+// Called by the build entry points, and by callers that free indexes and probe others in their place
+inline void invalidate_decoded_caches() {
+    decoded_cache_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Build a compressed frequency index from input data
+// Returns empty vector if index is not cost-effective
+std::vector<std::byte> build_idx(std::span<const uint32_t> data, Parameters config){
+    thread_local IndexBuilder builder;
+    invalidate_decoded_caches();
+    return builder.build(data, config);
+}
+
+// Build data as an index of the given kind regardless of cost, see IndexBuilder::build_as
+std::vector<std::byte> build_idx_as(std::span<const uint32_t> data, Parameters config, IndexKind kind,
+                                    std::optional<ValueCodec> codec = std::nullopt){
+    thread_local IndexBuilder builder;
+    invalidate_decoded_caches();
+    return builder.build_as(data, config, kind, codec);
+}
+
+// Build indexes for all blocks at once, against the score of their summed storage
+// Pass one collects every block's candidates (IndexBuilder::options). Pass two starts every block
+// without an index and hands out bytes greedily, always to the upgrade that skips the most scans
+// per byte: upgrades are the steps along the upper convex hull of a block's (bytes, skips) options.
+// Upgrades are taken while they earn more than F_S per KiB and fit budget_bytes; a block whose next
+// step does not fit moves on to the hull of its options that do. The bytes left in the last started
+// KiB cost nothing, so they are then filled with whatever upgrades still fit.
+// Even without a budget this is not build_idx per block. build_idx takes the candidate with the best
+// priced benefit and only then swaps in the affordable Eytzinger or perfect hash layout, while here
+// every option is priced at its finished size and only hull points can be reached. So a block may
+// keep a smaller option whose upgrade earns less than F_S per KiB, and total sizes usually differ.
+std::vector<std::vector<std::byte>> build_global_idx(std::span<const std::span<const uint32_t>> blocks, Parameters config,
+                                                     size_t budget_bytes = SIZE_MAX){
+    invalidate_decoded_caches();
+    const CostModel model(config);
+    const double byte_price = model.f_s / 1024.0;
+
+    struct Step {
+        size_t option;
+        size_t bytes;
+        double value;
+    };
+    std::vector<std::vector<IndexOption>> options(blocks.size());
+    {
+        IndexBuilder builder;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            options[b] = builder.options(blocks[b], config);
+        }
+    }
+    // Upper convex hull of the options of block b that are larger than from and at most max_bytes,
+    // starting at from
+    auto make_hull = [&](size_t b, const Step& from, size_t max_bytes) {
+        std::vector<Step> points;
+        for (size_t o = 0; o < options[b].size(); o++) {
+            const size_t bytes = options[b][o].index.size();
+            if (bytes > from.bytes && bytes <= max_bytes) {
+                points.push_back({o, bytes, options[b][o].skips * model.f_a});
+            }
+        }
+        std::sort(points.begin(), points.end(), [](const Step& x, const Step& y) {
+            return x.bytes != y.bytes ? x.bytes < y.bytes : x.value > y.value;
+        });
+        std::vector<Step> hull{from};
+        for (const auto& point : points) {
+            if (point.value <= hull.back().value) {
+                continue;  // Dominated by a smaller option
+            }
+            // Drop hull points that the new one makes non-concave
+            while (hull.size() >= 2) {
+                const Step& p0 = hull[hull.size() - 2];
+                const Step& p1 = hull.back();
+                if ((p1.value - p0.value) * static_cast<double>(point.bytes - p0.bytes) >
+                    (point.value - p0.value) * static_cast<double>(p1.bytes - p0.bytes)) {
+                    break;
+                }
+                hull.pop_back();
+            }
+            hull.push_back(point);
+        }
+        return hull;
+    };
+    // Hull of every block, starting at the block without an index
+    std::vector<std::vector<Step>> hulls(blocks.size());
+    for (size_t b = 0; b < blocks.size(); b++) {
+        hulls[b] = make_hull(b, {SIZE_MAX, 0, 0.0}, SIZE_MAX);
+    }
+
+    // Next upgrade of every block, best value per byte first
+    std::vector<size_t> position(blocks.size(), 0);
+    auto ratio = [&](size_t b) {
+        const Step& from = hulls[b][position[b]];
+        const Step& to = hulls[b][position[b] + 1];
+        return (to.value - from.value) / static_cast<double>(to.bytes - from.bytes);
+    };
+    auto by_ratio = [&](size_t x, size_t y) { return ratio(x) < ratio(y); };
+    std::vector<size_t> upgrades;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        if (hulls[b].size() > 1) {
+            upgrades.push_back(b);
+        }
+    }
+    std::make_heap(upgrades.begin(), upgrades.end(), by_ratio);
+
+    size_t total_bytes = 0;
+    auto allocate = [&](double min_ratio, size_t limit) {
+        while (!upgrades.empty() && ratio(upgrades.front()) > min_ratio) {
+            std::pop_heap(upgrades.begin(), upgrades.end(), by_ratio);
+            const size_t b = upgrades.back();
+            upgrades.pop_back();
+            const Step from = hulls[b][position[b]];
+            if (hulls[b][position[b] + 1].bytes - from.bytes > limit - total_bytes) {
+                // The step does not fit, but a smaller option of the block that it hid may: continue
+                // along the hull of only the options that still fit. Every rebuild drops an option.
+                hulls[b] = make_hull(b, from, from.bytes + (limit - total_bytes));
+                position[b] = 0;
+            } else {
+                total_bytes += hulls[b][position[b] + 1].bytes - from.bytes;
+                position[b]++;
+            }
+            if (position[b] + 1 < hulls[b].size()) {
+                upgrades.push_back(b);
+                std::push_heap(upgrades.begin(), upgrades.end(), by_ratio);
+            }
+        }
+    };
+    allocate(byte_price, budget_bytes);
+    const size_t charged_bytes = total_bytes == 0 ? 0 : (total_bytes + 1023) / 1024 * 1024;
+    allocate(0.0, std::min(budget_bytes, charged_bytes));
+
+    std::vector<std::vector<std::byte>> indexes(blocks.size());
+    for (size_t b = 0; b < blocks.size(); b++) {
+        if (const size_t option = hulls[b][position[b]].option; option != SIZE_MAX) {
+            indexes[b] = std::move(options[b][option].index);
+        }
+    }
+    return indexes;
+}
+
+// Query a Legacy index: decode the delta-encoded values from the start until predicate
+inline std::optional<size_t> query_legacy_idx(uint32_t predicate, std::span<const std::byte> index) {
+    const uint32_t num_indexed = load_u32(index.data());
+    const uint32_t counts_offset = load_u32(index.data() + 4);
+
+    // Decode delta-encoded values to find the predicate
+    size_t value_offset = 8;
+    uint32_t current_value = 0;
+
+    for (uint32_t i = 0; i < num_indexed; i++) {
+        if (i == 0) {
+            current_value = decode_varint(index.data(), value_offset);
+        } else {
+            uint32_t delta = decode_varint(index.data(), value_offset);
+            current_value += delta;
+        }
+
+        if (current_value == predicate) {
+            return lookup_count(index, counts_offset, num_indexed, i, false);
+        }
+
+        // Values are sorted, so we can early exit
+        if (current_value > predicate) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// Find the position of predicate among varint stripes whose skip table starts at skip_table_offset
+inline std::optional<size_t> find_in_stripes(uint32_t predicate, std::span<const std::byte> index,
+                                             size_t skip_table_offset, size_t num_indexed) {
+    const std::byte* skip_table = index.data() + skip_table_offset;
+    const size_t num_stripes = (num_indexed + kSkipStride - 1) / kSkipStride;
+
+    if (num_stripes == 0 || predicate < load_u32(skip_table)) {
+        return std::nullopt;
+    }
+
+    // Find the last stripe whose head value is <= predicate
+    size_t lo = 0;
+    size_t hi = num_stripes;
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (load_u32(skip_table + mid * kSkipEntryBytes) <= predicate) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const std::byte* entry = skip_table + lo * kSkipEntryBytes;
+    uint32_t current_value = load_u32(entry);
+    size_t value_offset = load_u32(entry + 4);
+    const size_t first_idx = lo * kSkipStride;
+    const size_t last_idx = std::min<size_t>(first_idx + kSkipStride, num_indexed);
+
+    for (size_t i = first_idx; i < last_idx; i++) {
+        if (i != first_idx) {
+            current_value += decode_varint(index.data(), value_offset);
+        }
+
+        if (current_value == predicate) {
+            return i;
+        }
+
+        // Values are sorted, so we can early exit
+        if (current_value > predicate) {
+            return std::nullopt;
+        }
+    }
+
+    return std::nullopt;
+}
+
+// Decode the num_deltas deltas of one varint stripe
+inline void decode_varint_deltas(const std::byte* deltas_begin, const std::byte*, size_t num_deltas, uint32_t* deltas) {
+    size_t offset = 0;
+    for (size_t k = 0; k < num_deltas; k++) {
+        deltas[k] = decode_varint(deltas_begin, offset);
+    }
+}
+
+#ifdef COUNT_FULL_FRAME_UNPACKS
+// Full PFOR frames this thread unpacked on the unrolled path, read by bench --check
+inline thread_local size_t full_frame_unpacks = 0;
+#endif
+
+// Unpack num_values values of Width bits each; with the width known at compile time the
+// offsets, shifts and mask of every value are constants and the deltas of full frames unroll completely
+template <uint8_t Width>
+inline void unpack_bits_fixed(const std::byte* packed, const std::byte* end, size_t num_values, uint32_t* output) {
+    constexpr uint64_t mask = (uint64_t{1} << Width) - 1;
+    if (num_values == kPforFrameDeltas && packed + (kPforFrameDeltas * Width + 7) / 8 + sizeof(uint64_t) <= end) {
+#ifdef COUNT_FULL_FRAME_UNPACKS
+        full_frame_unpacks++;
+#endif
+        for (size_t k = 0; k < kPforFrameDeltas; k++) {
+            uint64_t word;
+            std::memcpy(&word, packed + k * Width / 8, sizeof(uint64_t));
+            output[k] = static_cast<uint32_t>((word >> (k * Width % 8)) & mask);
+        }
+        return;
+    }
+    for (size_t k = 0; k < num_values; k++) {
+        const size_t bit = k * Width;
+        output[k] = static_cast<uint32_t>((load_word(packed + bit / 8, end) >> (bit % 8)) & mask);
+    }
+}
+
+using UnpackBitsFn = void (*)(const std::byte*, const std::byte*, size_t, uint32_t*);
+
+// One unpack kernel per bit width 0 to 32, picked once per frame by the width in its header
+template <size_t... Widths>
+constexpr std::array<UnpackBitsFn, sizeof...(Widths)> make_unpack_kernels(std::index_sequence<Widths...>) {
+    return {&unpack_bits_fixed<static_cast<uint8_t>(Widths)>...};
+}
+
+inline constexpr auto kUnpackKernels = make_unpack_kernels(std::make_index_sequence<33>());
+
+// Unpack num_values values of the given bit width from a little-endian bit stream
+inline void unpack_bits(const std::byte* packed, const std::byte* end, uint8_t width, size_t num_values, uint32_t* output) {
+    kUnpackKernels[width](packed, end, num_values, output);
+}
+
+// Unpack the num_deltas deltas of one PFOR frame and patch in its exceptions
+inline void decode_frame_deltas(const std::byte* frame, const std::byte* end, size_t num_deltas, uint32_t* deltas) {
+    const auto width = static_cast<uint8_t>(frame[0]);
+    const auto num_exceptions = static_cast<size_t>(frame[1]);
+    const std::byte* packed = frame + kPforFrameHeaderBytes;
+    unpack_bits(packed, end, width, num_deltas, deltas);
+
+    size_t exception_offset = (num_deltas * width + 7) / 8;
+    for (size_t e = 0; e < num_exceptions; e++) {
+        const auto position = static_cast<size_t>(packed[exception_offset++]);
+        deltas[position] |= decode_varint(packed, exception_offset) << width;
+    }
+}
+
+// Find the position of predicate among PFOR frames whose frame table starts at table_offset
+// Binary-searches the frame table, then unpacks and patches a single frame
+inline std::optional<size_t> find_in_frames(uint32_t predicate, std::span<const std::byte> index,
+                                            size_t table_offset, size_t num_indexed) {
+    const std::byte* frame_table = index.data() + table_offset;
+    const size_t num_frames = (num_indexed + kPforFrame - 1) / kPforFrame;
+
+    if (num_frames == 0 || predicate < load_u32(frame_table)) {
+        return std::nullopt;
+    }
+
+    // Find the last frame whose head value is <= predicate
+    size_t lo = 0;
+    size_t hi = num_frames;
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (load_u32(frame_table + mid * kPforEntryBytes) <= predicate) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const size_t first_idx = lo * kPforFrame;
+    uint32_t current_value = load_u32(frame_table + lo * kPforEntryBytes);
+    if (current_value == predicate) {
+        return first_idx;
+    }
+
+    const size_t num_deltas = std::min(kPforFrame, num_indexed - first_idx) - 1;
+    std::array<uint32_t, kPforFrameDeltas> deltas;
+    decode_frame_deltas(index.data() + load_u32(frame_table + lo * kPforEntryBytes + 4),
+                        index.data() + payload_size(index), num_deltas, deltas.data());
+
+    for (size_t k = 0; k < num_deltas; k++) {
+        current_value += deltas[k];
+        if (current_value == predicate) {
+            return first_idx + k + 1;
+        }
+        if (current_value > predicate) {
+            return std::nullopt;
+        }
+    }
+    return std::nullopt;
+}
+
+// Stream VByte decode tables: per control byte, the shuffle that widens its four
+// deltas to 32-bit lanes (0xFF zeroes a byte) and the number of data bytes consumed
+struct StreamVByteTables {
+    std::array<std::array<uint8_t, 16>, 256> shuffle;
+    std::array<uint8_t, 256> length;
+};
+
+constexpr StreamVByteTables make_svb_tables() {
+    StreamVByteTables tables{};
+    for (size_t control = 0; control < 256; control++) {
+        uint8_t source = 0;
+        for (size_t lane = 0; lane < 4; lane++) {
+            const size_t length = ((control >> (2 * lane)) & 3) + 1;
+            for (size_t byte = 0; byte < 4; byte++) {
+                tables.shuffle[control][lane * 4 + byte] = byte < length ? source++ : 0xFF;
+            }
+        }
+        tables.length[control] = source;
+    }
+    return tables;
+}
+
+inline constexpr StreamVByteTables kSvbTables = make_svb_tables();
+
+// Find predicate among the num_deltas deltas of one Stream VByte stripe starting at head
+// Returns the position within the stripe (1 for the first delta)
+using SvbFindFn = std::optional<size_t> (*)(const std::byte*, const std::byte*, size_t, uint32_t, uint32_t);
+
+inline std::optional<size_t> svb_find_scalar(const std::byte* control, const std::byte* end,
+                                             size_t num_deltas, uint32_t head, uint32_t predicate) {
+    const std::byte* data = control + (num_deltas + 3) / 4;
+    uint32_t current_value = head;
+    for (size_t k = 0; k < num_deltas; k++) {
+        const size_t length = ((static_cast<uint32_t>(control[k / 4]) >> (2 * (k % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        std::memcpy(&delta, data, std::min<size_t>(length, end - data));
+        data += length;
+        current_value += delta;
+        if (current_value == predicate) {
+            return k + 1;
+        }
+        if (current_value > predicate) {
+            return std::nullopt;
+        }
+    }
+    return std::nullopt;
+}
+
+// Decode the num_deltas deltas of one Stream VByte stripe
+inline void decode_svb_deltas(const std::byte* control, const std::byte* end, size_t num_deltas, uint32_t* deltas) {
+    const std::byte* data = control + (num_deltas + 3) / 4;
+    for (size_t k = 0; k < num_deltas; k++) {
+        const size_t length = ((static_cast<uint32_t>(control[k / 4]) >> (2 * (k % 4))) & 3) + 1;
+        deltas[k] = 0;
+        std::memcpy(&deltas[k], data, std::min<size_t>(length, end - data));
+        data += length;
+    }
+}
+
+// Load the 16 data bytes of a control group, zero-padding past end
+inline void load_svb_group(const std::byte* data, const std::byte* end, uint8_t* group) {
+    std::memset(group, 0, 16);
+    std::memcpy(group, data, std::min<size_t>(16, end - data));
+}
+
+#ifdef USER_SIMD_X86
+// Widen four deltas per control byte with one shuffle, prefix-sum them in register
+// and compare all four running values against predicate at once
+__attribute__((target("ssse3,sse4.1")))
+inline std::optional<size_t> svb_find_sse(const std::byte* control, const std::byte* end,
+                                          size_t num_deltas, uint32_t head, uint32_t predicate) {
+    const std::byte* data = control + (num_deltas + 3) / 4;
+    const __m128i needle = _mm_set1_epi32(static_cast<int>(predicate));
+    __m128i previous = _mm_set1_epi32(static_cast<int>(head));
+    for (size_t k = 0; k < num_deltas; k += 4) {
+        const auto control_byte = static_cast<uint8_t>(control[k / 4]);
+        alignas(16) uint8_t group[16];
+        load_svb_group(data, end, group);
+        data += kSvbTables.length[control_byte];
+
+        __m128i values = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(group)),
+                                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(kSvbTables.shuffle[control_byte].data())));
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+        values = _mm_add_epi32(values, previous);
+
+        // Lanes past the end of the stripe hold padding and are masked out
+        const unsigned valid = num_deltas - k >= 4 ? 0xF : (1u << (num_deltas - k)) - 1;
+        const __m128i reached = _mm_cmpeq_epi32(_mm_max_epu32(values, needle), values);
+        if (const unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(reached)) & valid; mask != 0) {
+            const unsigned lane = std::countr_zero(mask);
+            const unsigned equal = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, needle)));
+            if ((equal >> lane) & 1) {
+                return k + lane + 1;
+            }
+            return std::nullopt;
+        }
+        previous = _mm_shuffle_epi32(values, 0xFF);
+    }
+    return std::nullopt;
+}
+#endif
+
+#ifdef USER_SIMD_NEON
+inline std::optional<size_t> svb_find_neon(const std::byte* control, const std::byte* end,
+                                           size_t num_deltas, uint32_t head, uint32_t predicate) {
+    const std::byte* data = control + (num_deltas + 3) / 4;
+    const uint32x4_t zero = vdupq_n_u32(0);
+    uint32x4_t previous = vdupq_n_u32(head);
+    for (size_t k = 0; k < num_deltas; k += 4) {
+        const auto control_byte = static_cast<uint8_t>(control[k / 4]);
+        uint8_t group[16];
+        load_svb_group(data, end, group);
+        data += kSvbTables.length[control_byte];
+
+        uint32x4_t values = vreinterpretq_u32_u8(vqtbl1q_u8(vld1q_u8(group), vld1q_u8(kSvbTables.shuffle[control_byte].data())));
+        values = vaddq_u32(values, vextq_u32(zero, values, 3));
+        values = vaddq_u32(values, vextq_u32(zero, values, 2));
+        values = vaddq_u32(values, previous);
+
+        uint32_t lanes[4];
+        vst1q_u32(lanes, values);
+        const size_t num_lanes = std::min<size_t>(4, num_deltas - k);
+        for (size_t lane = 0; lane < num_lanes; lane++) {
+            if (lanes[lane] >= predicate) {
+                return lanes[lane] == predicate ? std::optional<size_t>(k + lane + 1) : std::nullopt;
+            }
+        }
+        previous = vdupq_n_u32(lanes[3]);
+    }
+    return std::nullopt;
+}
+#endif
+
+inline SvbFindFn select_svb_find() {
+#if defined(USER_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) {
+        return svb_find_sse;
+    }
+#elif defined(USER_SIMD_NEON)
+    return svb_find_neon;
+#endif
+    return svb_find_scalar;
+}
+
+// Find the position of predicate among Stream VByte stripes whose skip table starts at skip_table_offset
+inline std::optional<size_t> find_in_svb_stripes(uint32_t predicate, std::span<const std::byte> index,
+                                                 size_t skip_table_offset, size_t num_indexed) {
+    static const SvbFindFn find_in_stripe = select_svb_find();
+
+    const std::byte* skip_table = index.data() + skip_table_offset;
+    const size_t num_stripes = (num_indexed + kSkipStride - 1) / kSkipStride;
+
+    if (num_stripes == 0 || predicate < load_u32(skip_table)) {
+        return std::nullopt;
+    }
+
+    // Find the last stripe whose head value is <= predicate
+    size_t lo = 0;
+    size_t hi = num_stripes;
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (load_u32(skip_table + mid * kSkipEntryBytes) <= predicate) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const std::byte* entry = skip_table + lo * kSkipEntryBytes;
+    const uint32_t head = load_u32(entry);
+    const size_t first_idx = lo * kSkipStride;
+    if (head == predicate) {
+        return first_idx;
+    }
+    const size_t num_deltas = std::min<size_t>(kSkipStride, num_indexed - first_idx) - 1;
+    const auto position = find_in_stripe(index.data() + load_u32(entry + 4), index.data() + payload_size(index),
+                                         num_deltas, head, predicate);
+    if (!position) {
+        return std::nullopt;
+    }
+    return first_idx + *position;
+}
+
+// Look up predicate in a sorted section starting at section_offset
+// The section's size, counts offset and flags live in the first two header words
+// Returns the count of predicate, 0 if it is not stored
+inline size_t query_sorted_section(uint32_t predicate, std::span<const std::byte> index, size_t section_offset) {
+    const uint32_t num_indexed = load_u32(index.data()) & kDistinctMask;
+    const uint32_t counts_offset = load_u32(index.data() + 4);
+    const auto flags = static_cast<uint8_t>(index[3]);
+
+    std::optional<size_t> position;
+    switch (static_cast<ValueCodec>((flags & kCodecMask) >> kCodecShift)) {
+        case ValueCodec::Varint:
+            position = find_in_stripes(predicate, index, section_offset, num_indexed);
+            break;
+        case ValueCodec::StreamVByte:
+            position = find_in_svb_stripes(predicate, index, section_offset, num_indexed);
+            break;
+        case ValueCodec::Pfor:
+            position = find_in_frames(predicate, index, section_offset, num_indexed);
+            break;
+    }
+    if (!position) {
+        return 0;
+    }
+    return lookup_count(index, counts_offset, num_indexed, *position, (flags & kRankFlag) != 0);
+}
+
+// Query a Striped index: binary-search the skip table, then decode at most one stripe
+inline std::optional<size_t> query_striped_idx(uint32_t predicate, std::span<const std::byte> index) {
+    return query_sorted_section(predicate, index, 8);
+}
+
+// Check predicate against the fingerprints of a binary fuse filter over num_keys keys
+// False means definitely absent
+template <class Fingerprint>
+inline bool fuse_may_contain(uint32_t predicate, const std::byte* fingerprints, size_t num_keys, uint32_t seed) {
+    const BinaryFuseShape shape(num_keys);
+    const uint64_t hash = fuse_hash(predicate, seed);
+
+    Fingerprint check = fuse_fingerprint<Fingerprint>(hash);
+    for (const auto slot : shape.positions(hash)) {
+        Fingerprint fingerprint;
+        std::memcpy(&fingerprint, fingerprints + slot * sizeof(Fingerprint), sizeof(Fingerprint));
+        check ^= fingerprint;
+    }
+    return check == 0;
+}
+
+// Query a binary fuse filter: 0 if the fingerprints rule predicate out, otherwise unknown
+template <class Fingerprint>
+inline std::optional<size_t> query_fuse_idx(uint32_t predicate, std::span<const std::byte> index) {
+    if (fuse_may_contain<Fingerprint>(predicate, index.data() + kFuseHeaderBytes,
+                                      load_u32(index.data()) & kDistinctMask, load_u32(index.data() + 4))) {
+        return std::nullopt;
+    }
+    return 0;
+}
+
+// Offset of the heavy hitters' sorted section in a Hybrid index, right behind the tail filter
+template <class Fingerprint>
+inline size_t hybrid_section_offset(std::span<const std::byte> index) {
+    return kHybridHeaderBytes + BinaryFuseShape(load_u32(index.data() + 8)).array_length * sizeof(Fingerprint);
+}
+
+// Answer a predicate that is not a heavy hitter from the tail filter of a Hybrid index
+template <class Fingerprint>
+inline std::optional<size_t> query_hybrid_tail(uint32_t predicate, std::span<const std::byte> index) {
+    if (fuse_may_contain<Fingerprint>(predicate, index.data() + kHybridHeaderBytes,
+                                      load_u32(index.data() + 8), load_u32(index.data() + 12))) {
+        return std::nullopt;
+    }
+    return 0;
+}
+
+// Query a Hybrid index: exact count for heavy hitters, otherwise 0 or unknown from the tail filter
+template <class Fingerprint>
+inline std::optional<size_t> query_hybrid_idx(uint32_t predicate, std::span<const std::byte> index) {
+    if (const size_t count = query_sorted_section(predicate, index, hybrid_section_offset<Fingerprint>(index)); count != 0) {
+        return count;
+    }
+    return query_hybrid_tail<Fingerprint>(predicate, index);
+}
+
+// Query a Range index: 0 if predicate falls into an empty zone, otherwise unknown
+inline std::optional<size_t> query_range_idx(uint32_t predicate, std::span<const std::byte> index) {
+    const std::byte* trailer = index.data() + payload_size(index);
+    uint64_t zone_map;
+    std::memcpy(&zone_map, index.data() + 4, sizeof(uint64_t));
+    if ((zone_map >> zone_bucket(predicate, load_u32(trailer), load_u32(trailer + 4)) & 1) == 0) {
+        return 0;
+    }
+    return std::nullopt;
+}
+
+// Decode the values of a sorted section's blocks, whose block table starts at table_offset, into values
+template <size_t BlockSize, class DecodeDeltas>
+inline void decode_blocks(std::span<const std::byte> index, size_t table_offset, size_t num_indexed,
+                          DecodeDeltas decode_deltas, uint32_t* values) {
+    const std::byte* table = index.data() + table_offset;
+    const std::byte* end = index.data() + payload_size(index);
+    for (size_t first_idx = 0; first_idx < num_indexed; first_idx += BlockSize) {
+        const std::byte* entry = table + first_idx / BlockSize * kSkipEntryBytes;
+        const size_t num_values = std::min(BlockSize, num_indexed - first_idx);
+        values[first_idx] = load_u32(entry);
+        decode_deltas(index.data() + load_u32(entry + 4), end, num_values - 1, values + first_idx + 1);
+        for (size_t k = first_idx + 1; k < first_idx + num_values; k++) {
+            values[k] += values[k - 1];
+        }
+    }
+}
+
+// Decode the counts of all num_indexed entries of the counts section at counts_offset
+inline void decode_counts(std::span<const std::byte> index, size_t counts_offset, size_t num_indexed, uint32_t* counts) {
+    const std::byte* bitmap = index.data() + counts_offset;
+    size_t varint_offset = counts_offset + (num_indexed + 7) / 8;
+    for (size_t i = 0; i < num_indexed; i++) {
+        counts[i] = (static_cast<uint32_t>(bitmap[i / 8]) >> (i % 8) & 1) != 0 ? 1 : decode_varint(index.data(), varint_offset) + 2;
+    }
+}
+
+// Sorted values and counts of an index, laid out in Eytzinger (BFS) order for branchless search
+// Slot 0 is unused, so the children of slot k are 2k and 2k + 1
+struct DecodedIndex {
+    std::vector<uint32_t> values;
+    std::vector<uint32_t> counts;
+
+    // Count of predicate, 0 if it is not stored
+    size_t count(uint32_t predicate) const {
+        const size_t n = values.size() - 1;
+        size_t k = 1;
+        while (k <= n) {
+            // The 16 great-grandchildren share a cache line, fetch them ahead of the compares
+            __builtin_prefetch(values.data() + std::min(16 * k, n));
+            k = 2 * k + (values[k] < predicate);
+        }
+        k = eytzinger_lower_bound_slot(k);
+        return k != 0 && values[k] == predicate ? counts[k] : 0;
+    }
+
+    size_t bytes() const {
+        return (values.capacity() + counts.capacity()) * sizeof(uint32_t);
+    }
+
+    void assign(std::span<const uint32_t> sorted_values, std::span<const uint32_t> sorted_counts) {
+        values.resize(sorted_values.size() + 1);
+        counts.resize(sorted_values.size() + 1);
+        eytzinger_visit(sorted_values.size(), 1, 0, [&](size_t slot, size_t rank) {
+            values[slot] = sorted_values[rank];
+            counts[slot] = sorted_counts[rank];
+        });
+    }
+};
+
+// Per-thread memory budget of the decoded-index cache in bytes, 0 disables it
+inline std::atomic<size_t> decoded_cache_budget{0};
+
+inline void set_decoded_cache_budget(size_t bytes) {
+    decoded_cache_budget.store(bytes, std::memory_order_relaxed);
+}
+
+// Bounded cache of decoded exact sections, materialized on first probe and evicted with CLOCK
+// Once the budget is full, a block is only admitted over a CLOCK victim that was probed less
+// often, so scans over more blocks than fit keep a stable cached set instead of thrashing.
+// Entries are keyed by the address of the compressed index and checked against its size and
+// header; all of them are dropped once decoded_cache_generation moves on, so an index built at the
+// address of a freed one is never answered from the freed one's entry. Entries live beside the
+// compressed bytes and do not count towards the storage size.
+class DecodedIndexCache {
+public:
+    // Decoded exact section of index, nullptr if its kind has none or it is not admitted
+    const DecodedIndex* find(std::span<const std::byte> index, IndexKind kind, size_t budget) {
+        if (const uint64_t current = decoded_cache_generation.load(std::memory_order_relaxed); current != generation) {
+            clear();
+            generation = current;
+        }
+        const uint64_t header = load_word(index.data(), index.data() + index.size());
+        age();
+        Block& block = blocks[index.data()];
+        block.probes++;
+        if (block.slot != kNoSlot) {
+            Slot& slot = slots[block.slot];
+            if (slot.size == index.size() && slot.header == header) {
+                slot.referenced = true;
+                return &slot.decoded;
+            }
+            evict(block.slot);
+            block.probes = 1;
+        }
+
+        const auto num_indexed = exact_entries(index, kind);
+        if (!num_indexed || !make_room((2 * *num_indexed + 2) * sizeof(uint32_t), budget, block.probes)) {
+            return nullptr;
+        }
+        decode(index, kind);
+
+        size_t position = slots.size();
+        if (!free_slots.empty()) {
+            position = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slots.emplace_back();
+        }
+        Slot& slot = slots[position];
+        slot.data = index.data();
+        slot.size = index.size();
+        slot.header = header;
+        slot.referenced = true;
+        slot.decoded.assign(sorted_values, sorted_counts);
+        bytes_used += slot.decoded.bytes();
+        blocks[index.data()].slot = position;
+        return &slot.decoded;
+    }
+
+private:
+    static constexpr size_t kNoSlot = SIZE_MAX;
+    // Probe counts are halved every kAgingProbes probes, so admission follows workload shifts
+    static constexpr size_t kAgingProbes = size_t{1} << 20;
+
+    struct Block {
+        uint32_t probes = 0;
+        size_t slot = kNoSlot;
+    };
+
+    struct Slot {
+        const std::byte* data = nullptr;
+        size_t size = 0;
+        uint64_t header = 0;
+        bool referenced = false;
+        DecodedIndex decoded;
+    };
+
+    // Number of exactly stored values, unset for kinds without an exact section
+    static std::optional<size_t> exact_entries(std::span<const std::byte> index, IndexKind kind) {
+        switch (kind) {
+            case IndexKind::Legacy:
+                return load_u32(index.data());
+            case IndexKind::Striped:
+            case IndexKind::Hybrid8:
+            case IndexKind::Hybrid16:
+                return load_u32(index.data()) & kDistinctMask;
+            default:
+                return std::nullopt;
+        }
+    }
+
+    // Evict CLOCK victims until need more bytes fit; false if a victim was probed at least
+    // as often as the candidate, leaving the cache as it is
+    bool make_room(size_t need, size_t budget, uint32_t candidate_probes) {
+        if (need > budget) {
+            return false;
+        }
+        // Two sweeps: the first one may only clear reference bits
+        for (size_t step = 0; step < 2 * slots.size() && bytes_used + need > budget; step++) {
+            Slot& slot = slots[hand];
+            if (slot.data != nullptr) {
+                if (slot.referenced) {
+                    slot.referenced = false;
+                } else if (blocks[slot.data].probes >= candidate_probes) {
+                    return false;
+                } else {
+                    evict(hand);
+                }
+            }
+            hand = (hand + 1) % slots.size();
+        }
+        return bytes_used + need <= budget;
+    }
+
+    void age() {
+        if (++probes_since_aging < kAgingProbes) {
+            return;
+        }
+        probes_since_aging = 0;
+        for (auto it = blocks.begin(); it != blocks.end();) {
+            it->second.probes /= 2;
+            it = it->second.probes == 0 && it->second.slot == kNoSlot ? blocks.erase(it) : std::next(it);
+        }
+    }
+
+    // Decode the exact section of index into sorted_values and sorted_counts
+    void decode(std::span<const std::byte> index, IndexKind kind) {
+        size_t section_offset = 8;
+        switch (kind) {
+            case IndexKind::Legacy: {
+                const uint32_t num_indexed = load_u32(index.data());
+                sorted_values.resize(num_indexed);
+                sorted_counts.resize(num_indexed);
+                size_t value_offset = 8;
+                uint32_t current_value = 0;
+                for (uint32_t i = 0; i < num_indexed; i++) {
+                    current_value += decode_varint(index.data(), value_offset);
+                    sorted_values[i] = current_value;
+                }
+                decode_counts(index, load_u32(index.data() + 4), num_indexed, sorted_counts.data());
+                return;
+            }
+            case IndexKind::Hybrid8:
+                section_offset = hybrid_section_offset<uint8_t>(index);
+                break;
+            case IndexKind::Hybrid16:
+                section_offset = hybrid_section_offset<uint16_t>(index);
+                break;
+            default:
+                break;
+        }
+
+        const uint32_t num_indexed = load_u32(index.data()) & kDistinctMask;
+        sorted_values.resize(num_indexed);
+        sorted_counts.resize(num_indexed);
+        switch (static_cast<ValueCodec>((static_cast<uint8_t>(index[3]) & kCodecMask) >> kCodecShift)) {
+            case ValueCodec::Varint:
+                decode_blocks<kSkipStride>(index, section_offset, num_indexed, decode_varint_deltas, sorted_values.data());
+                break;
+            case ValueCodec::StreamVByte:
+                decode_blocks<kSkipStride>(index, section_offset, num_indexed, decode_svb_deltas, sorted_values.data());
+                break;
+            case ValueCodec::Pfor:
+                decode_blocks<kPforFrame>(index, section_offset, num_indexed, decode_frame_deltas, sorted_values.data());
+                break;
+        }
+        decode_counts(index, load_u32(index.data() + 4), num_indexed, sorted_counts.data());
+    }
+
+    void clear() {
+        slots.clear();
+        free_slots.clear();
+        blocks.clear();
+        probes_since_aging = 0;
+        hand = 0;
+        bytes_used = 0;
+    }
+
+    void evict(size_t position) {
+        Slot& slot = slots[position];
+        blocks[slot.data].slot = kNoSlot;
+        bytes_used -= slot.decoded.bytes();
+        slot.data = nullptr;
+        slot.decoded = DecodedIndex{};
+        free_slots.push_back(position);
+    }
+
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    std::unordered_map<const std::byte*, Block> blocks;
+    size_t probes_since_aging = 0;
+    size_t hand = 0;
+    size_t bytes_used = 0;
+    uint64_t generation = 0;
+    std::vector<uint32_t> sorted_values;
+    std::vector<uint32_t> sorted_counts;
+};
+
+// Answer predicate from the calling thread's decoded-index cache if it is enabled
+// Heavy-hitter misses of Hybrid indexes still go to the tail filter
+inline std::optional<std::optional<size_t>> query_decoded_cache(uint32_t predicate, std::span<const std::byte> index, IndexKind kind) {
+    const size_t budget = decoded_cache_budget.load(std::memory_order_relaxed);
+    if (budget == 0) {
+        return std::nullopt;
+    }
+    thread_local DecodedIndexCache cache;
+    const DecodedIndex* decoded = cache.find(index, kind, budget);
+    if (decoded == nullptr) {
+        return std::nullopt;
+    }
+    if (const size_t count = decoded->count(predicate); count != 0) {
+        return count;
+    }
+    switch (kind) {
+        case IndexKind::Hybrid8:
+            return query_hybrid_tail<uint8_t>(predicate, index);
+        case IndexKind::Hybrid16:
+            return query_hybrid_tail<uint16_t>(predicate, index);
+        default:
+            return std::optional<size_t>(0);
+    }
+}
+
+// Load a little-endian unsigned integer of Width bytes
+template <size_t Width>
+inline uint32_t load_uint(const std::byte* input) {
+    uint32_t value = 0;
+    std::memcpy(&value, input, Width);
+    return value;
+}
+
+// Call visit.template operator()<Width>() for a stored byte width of 1 to 4
+// Decoders instantiate their loops per width, so loads and strides are compile-time constants
+template <class Visit>
+inline void visit_byte_width(size_t width, Visit&& visit) {
+    switch (width) {
+        case 1:
+            visit.template operator()<1>();
+            return;
+        case 2:
+            visit.template operator()<2>();
+            return;
+        case 3:
+            visit.template operator()<3>();
+            return;
+        case 4:
+            visit.template operator()<4>();
+            return;
+        default:
+            // Builders only store widths 1 to 4
+            __builtin_unreachable();
+    }
+}
+
+// Branch-free descent of an Eytzinger tree of n keys of KeyWidth bytes for key
+template <size_t KeyWidth, size_t CountWidth>
+inline size_t eytzinger_find(uint32_t key, const std::byte* keys, size_t n) {
+    // Slot k lives at keys[k - 1]
+    const std::byte* slots = keys - KeyWidth;
+    size_t k = 1;
+    while (k <= n) {
+        // The 16 great-grandchildren share a cache line, fetch them ahead of the compares
+        __builtin_prefetch(slots + std::min(16 * k, n) * KeyWidth);
+        k = 2 * k + (load_uint<KeyWidth>(slots + k * KeyWidth) < key);
+    }
+    k = eytzinger_lower_bound_slot(k);
+    if (k == 0 || load_uint<KeyWidth>(slots + k * KeyWidth) != key) {
+        return 0;
+    }
+    return load_uint<CountWidth>(keys + n * KeyWidth + (k - 1) * CountWidth);
+}
+
+// Query an Eytzinger index through the instantiation for its key and count widths
+// The range trailer already rejected predicates below min, so the key never wraps
+inline std::optional<size_t> query_eytzinger_idx(uint32_t predicate, std::span<const std::byte> index) {
+    const size_t n = load_u32(index.data()) & kDistinctMask;
+    const uint32_t widths = load_u32(index.data() + 4);
+    const uint32_t key = predicate - load_u32(index.data() + payload_size(index));
+    size_t count = 0;
+    visit_byte_width(widths >> 8 & 0xFF, [&]<size_t KeyWidth>() {
+        visit_byte_width(widths & 0xFF, [&]<size_t CountWidth>() {
+            count = eytzinger_find<KeyWidth, CountWidth>(key, index.data() + 8, n);
+        });
+    });
+    return count;
+}
+
+// Query a PerfectHash index: hash to the slot, then compare the key stored there
+// The range trailer already rejected predicates below min, so the key never wraps
+inline std::optional<size_t> query_perfect_hash_idx(uint32_t predicate, std::span<const std::byte> index) {
+    const size_t n = load_u32(index.data()) & kDistinctMask;
+    const uint32_t widths = load_u32(index.data() + 4);
+    const size_t num_levels = widths & 0xFF;
+    const size_t key_width = widths >> 8 & 0xFF;
+    const size_t count_width = widths >> 16 & 0xFF;
+    const uint32_t min = load_u32(index.data() + payload_size(index));
+
+    const std::byte* level_words = index.data() + kPhfHeaderBytes;
+    size_t num_words = 0;
+    for (size_t level = 0; level < num_levels; level++) {
+        num_words += load_u32(level_words + level * sizeof(uint32_t));
+    }
+    const std::byte* bits = level_words + num_levels * sizeof(uint32_t);
+    const std::byte* ranks = bits + num_words * sizeof(uint64_t);
+    const std::byte* keys = ranks + (num_words + kPhfRankWords - 1) / kPhfRankWords * sizeof(uint32_t);
+
+    const auto slot = perfect_hash_slot(predicate, level_words, num_levels, bits, ranks);
+    if (!slot) {
+        return 0;
+    }
+    size_t count = 0;
+    visit_byte_width(key_width, [&]<size_t KeyWidth>() {
+        if (predicate - min != load_uint<KeyWidth>(keys + *slot * KeyWidth)) {
+            return;
+        }
+        visit_byte_width(count_width, [&]<size_t CountWidth>() {
+            count = load_uint<CountWidth>(keys + n * KeyWidth + *slot * CountWidth);
+        });
+    });
+    return count;
+}
+
+// Merge-join sorted predicates against the blocks of a sorted section whose block table starts at table_offset
+// Table entries hold a block's head value and the offset of its deltas, as in the skip and frame tables.
+// Every block is decoded at most once; positions[i] receives the position of predicates[i]
+template <size_t BlockSize, class DecodeDeltas>
+inline void find_batch_in_blocks(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                                 size_t table_offset, size_t num_indexed, DecodeDeltas decode_deltas,
+                                 std::span<std::optional<size_t>> positions) {
+    const std::byte* table = index.data() + table_offset;
+    const std::byte* end = index.data() + payload_size(index);
+    const size_t num_blocks = (num_indexed + BlockSize - 1) / BlockSize;
+
+    std::array<uint32_t, BlockSize> values;
+    size_t decoded_block = num_blocks;
+    size_t num_values = 0;
+    size_t block = 0;
+    size_t k = 0;
+
+    for (size_t i = 0; i < predicates.size(); i++) {
+        const uint32_t predicate = predicates[i];
+        positions[i] = std::nullopt;
+        if (num_blocks == 0 || predicate < load_u32(table)) {
+            continue;
+        }
+
+        // Predicates are sorted, so the block only moves forward
+        size_t lo = block;
+        size_t hi = num_blocks;
+        while (hi - lo > 1) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (load_u32(table + mid * kSkipEntryBytes) <= predicate) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        block = lo;
+
+        if (block != decoded_block) {
+            const size_t first_idx = block * BlockSize;
+            num_values = std::min(BlockSize, num_indexed - first_idx);
+            values[0] = load_u32(table + block * kSkipEntryBytes);
+            decode_deltas(index.data() + load_u32(table + block * kSkipEntryBytes + 4), end, num_values - 1, values.data() + 1);
+            for (size_t v = 1; v < num_values; v++) {
+                values[v] += values[v - 1];
+            }
+            decoded_block = block;
+            k = 0;
+        }
+
+        while (k < num_values && values[k] < predicate) {
+            k++;
+        }
+        if (k < num_values && values[k] == predicate) {
+            positions[i] = block * BlockSize + k;
+        }
+    }
+}
+
+// Batched query_sorted_section: counts[i] receives the count of predicates[i], 0 if it is not stored
+inline void query_sorted_section_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                                       size_t section_offset, std::span<std::optional<size_t>> counts) {
+    const uint32_t num_indexed = load_u32(index.data()) & kDistinctMask;
+    const uint32_t counts_offset = load_u32(index.data() + 4);
+    const auto flags = static_cast<uint8_t>(index[3]);
+
+    switch (static_cast<ValueCodec>((flags & kCodecMask) >> kCodecShift)) {
+        case ValueCodec::Varint:
+            find_batch_in_blocks<kSkipStride>(predicates, index, section_offset, num_indexed, decode_varint_deltas, counts);
+            break;
+        case ValueCodec::StreamVByte:
+            find_batch_in_blocks<kSkipStride>(predicates, index, section_offset, num_indexed, decode_svb_deltas, counts);
+            break;
+        case ValueCodec::Pfor:
+            find_batch_in_blocks<kPforFrame>(predicates, index, section_offset, num_indexed, decode_frame_deltas, counts);
+            break;
+    }
+    for (auto& count : counts) {
+        count = count ? lookup_count(index, counts_offset, num_indexed, *count, (flags & kRankFlag) != 0) : 0;
+    }
+}
+
+// Batched query_legacy_idx: a single pass over the delta-encoded values serves all predicates
+inline void query_legacy_idx_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                                   std::span<std::optional<size_t>> out) {
+    const uint32_t num_indexed = load_u32(index.data());
+    const uint32_t counts_offset = load_u32(index.data() + 4);
+
+    size_t value_offset = 8;
+    uint32_t current_value = 0;
+    uint32_t i = 0;
+    for (size_t p = 0; p < predicates.size(); p++) {
+        while (i < num_indexed && (i == 0 || current_value < predicates[p])) {
+            const uint32_t delta = decode_varint(index.data(), value_offset);
+            current_value = i == 0 ? delta : current_value + delta;
+            i++;
+        }
+        out[p] = i != 0 && current_value == predicates[p] ? lookup_count(index, counts_offset, num_indexed, i - 1, false) : 0;
+    }
+}
+
+// Rank of low among the num_values low keys of a Roaring container, unset if it is absent
+inline std::optional<size_t> roaring_container_rank(RoaringContainer type, const std::byte* container, size_t num_values, uint16_t low) {
+    switch (type) {
+        case RoaringContainer::Array: {
+            size_t lo = 0;
+            size_t hi = num_values;
+            while (lo < hi) {
+                const size_t mid = lo + (hi - lo) / 2;
+                if (load_uint<2>(container + mid * 2) < low) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == num_values || load_uint<2>(container + lo * 2) != low) {
+                return std::nullopt;
+            }
+            return lo;
+        }
+        case RoaringContainer::Bitset: {
+            const size_t w = low / 64;
+            uint64_t word;
+            std::memcpy(&word, container + w * sizeof(uint64_t), sizeof(word));
+            if ((word >> (low % 64) & 1) == 0) {
+                return std::nullopt;
+            }
+            size_t rank = load_uint<2>(container + kRoaringBitsetWords * sizeof(uint64_t) + w / kRoaringRankWords * 2);
+            for (size_t v = w / kRoaringRankWords * kRoaringRankWords; v < w; v++) {
+                uint64_t before;
+                std::memcpy(&before, container + v * sizeof(uint64_t), sizeof(before));
+                rank += std::popcount(before);
+            }
+            return rank + std::popcount(word & ((uint64_t{1} << (low % 64)) - 1));
+        }
+        case RoaringContainer::Run: {
+            const std::byte* runs = container + 2;
+            // Find the last run starting at or before low
+            size_t lo = 0;
+            size_t hi = load_uint<2>(container);
+            while (lo < hi) {
+                const size_t mid = lo + (hi - lo) / 2;
+                if (load_uint<2>(runs + mid * kRoaringRunBytes) <= low) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == 0) {
+                return std::nullopt;
+            }
+            const std::byte* run = runs + (lo - 1) * kRoaringRunBytes;
+            const uint32_t offset = low - load_uint<2>(run);
+            if (offset > load_uint<2>(run + 2)) {
+                return std::nullopt;
+            }
+            return load_uint<2>(run + 4) + offset;
+        }
+    }
+    return std::nullopt;
+}
+
+// Query a Roaring index: find the container of the high key, test the low key, read the count at its rank
+inline std::optional<size_t> query_roaring_idx(uint32_t predicate, std::span<const std::byte> index) {
+    const size_t n = load_u32(index.data()) & kDistinctMask;
+    const size_t num_containers = load_u32(index.data() + 8);
+    const std::byte* directory = index.data() + kRoaringHeaderBytes;
+    const uint32_t high = predicate >> 16;
+
+    size_t lo = 0;
+    size_t hi = num_containers;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (load_uint<2>(directory + mid * kRoaringEntryBytes) < high) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const std::byte* entry = directory + lo * kRoaringEntryBytes;
+    if (lo == num_containers || load_uint<2>(entry) != high) {
+        return 0;
+    }
+    const size_t first = load_u32(entry + 8);
+    const size_t next = lo + 1 < num_containers ? load_u32(entry + kRoaringEntryBytes + 8) : n;
+    const auto rank = roaring_container_rank(static_cast<RoaringContainer>(entry[2]), index.data() + load_u32(entry + 4),
+                                             next - first, static_cast<uint16_t>(predicate));
+    if (!rank) {
+        return 0;
+    }
+    return lookup_count(index, load_u32(index.data() + 4), n, first + *rank, (static_cast<uint8_t>(index[3]) & kRankFlag) != 0);
+}
+
+// Decoder of one index kind: query answers a single predicate, query_batch a sorted run of them
+// query_idx and query_idx_batch dispatch on the kind byte through these specializations, so a
+// new kind is one more specialization and the hot path makes no indirect calls
+template <IndexKind Kind>
+struct IndexFormat;
+
+// Formats that answer without decoding anything answer a batch one predicate at a time
+template <class Format>
+struct PointwiseBatch {
+    static void query_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                            std::span<std::optional<size_t>> results) {
+        for (size_t i = 0; i < predicates.size(); i++) {
+            results[i] = Format::query(predicates[i], index);
+        }
+    }
+};
+
+template <>
+struct IndexFormat<IndexKind::Legacy> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_legacy_idx(predicate, index);
+    }
+    static void query_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                            std::span<std::optional<size_t>> results) {
+        query_legacy_idx_batch(predicates, index, results);
+    }
+};
+
+template <>
+struct IndexFormat<IndexKind::Striped> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_striped_idx(predicate, index);
+    }
+    static void query_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                            std::span<std::optional<size_t>> results) {
+        query_sorted_section_batch(predicates, index, 8, results);
+    }
+};
+
+template <class Fingerprint>
+struct FuseFormat : PointwiseBatch<FuseFormat<Fingerprint>> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_fuse_idx<Fingerprint>(predicate, index);
+    }
+};
+
+template <> struct IndexFormat<IndexKind::Fuse8> : FuseFormat<uint8_t> {};
+template <> struct IndexFormat<IndexKind::Fuse16> : FuseFormat<uint16_t> {};
+
+// Heavy hitters are merge-joined like a Striped section, the rest go to the tail filter
+template <class Fingerprint>
+struct HybridFormat {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_hybrid_idx<Fingerprint>(predicate, index);
+    }
+    static void query_batch(std::span<const uint32_t> predicates, std::span<const std::byte> index,
+                            std::span<std::optional<size_t>> results) {
+        query_sorted_section_batch(predicates, index, hybrid_section_offset<Fingerprint>(index), results);
+        for (size_t i = 0; i < predicates.size(); i++) {
+            if (results[i] == 0) {
+                results[i] = query_hybrid_tail<Fingerprint>(predicates[i], index);
+            }
+        }
+    }
+};
+
+template <> struct IndexFormat<IndexKind::Hybrid8> : HybridFormat<uint8_t> {};
+template <> struct IndexFormat<IndexKind::Hybrid16> : HybridFormat<uint16_t> {};
+
+template <>
+struct IndexFormat<IndexKind::Range> : PointwiseBatch<IndexFormat<IndexKind::Range>> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_range_idx(predicate, index);
+    }
+};
+
+template <>
+struct IndexFormat<IndexKind::Eytzinger> : PointwiseBatch<IndexFormat<IndexKind::Eytzinger>> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_eytzinger_idx(predicate, index);
+    }
+};
+
+template <>
+struct IndexFormat<IndexKind::PerfectHash> : PointwiseBatch<IndexFormat<IndexKind::PerfectHash>> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_perfect_hash_idx(predicate, index);
+    }
+};
+
+template <>
+struct IndexFormat<IndexKind::Roaring> : PointwiseBatch<IndexFormat<IndexKind::Roaring>> {
+    static std::optional<size_t> query(uint32_t predicate, std::span<const std::byte> index) {
+        return query_roaring_idx(predicate, index);
+    }
+};
+
+// Call visit.template operator()<Kind>() for the format of kind; false for kinds without one
+// The fold expands into one comparison per kind, which the compiler turns into a jump table
+template <class Visit, size_t... Kinds>
+inline bool visit_index_format(IndexKind kind, Visit&& visit, std::index_sequence<Kinds...>) {
+    return ((kind == static_cast<IndexKind>(Kinds) &&
+             (visit.template operator()<IndexFormat<static_cast<IndexKind>(Kinds)>>(), true)) || ...);
+}
+
+template <class Visit>
+inline bool visit_index_format(IndexKind kind, Visit&& visit) {
+    return visit_index_format(kind, visit, std::make_index_sequence<kNumIndexKinds>());
+}
+
+// Query the frequency of a value in the index
+// Returns std::nullopt if no index, 0 if value not found, otherwise the count
+std::optional<size_t> query_idx(uint32_t predicate, std::span<const std::byte> index){
+    if (index.empty()) {
+        return std::nullopt;
+    }
+
+    // Out-of-range predicates are rejected from the trailer without touching the body
+    if ((static_cast<uint8_t>(index[3]) & kRangeFlag) != 0) {
+        const std::byte* trailer = index.data() + index.size() - kRangeTrailerBytes;
+        if (predicate < load_u32(trailer) || predicate > load_u32(trailer + 4)) {
+            return 0;
+        }
+    }
+
+    const auto kind = static_cast<IndexKind>(static_cast<uint8_t>(index[3]) & kKindMask);
+    if (const auto cached = query_decoded_cache(predicate, index, kind)) {
+        return *cached;
+    }
+
+    std::optional<size_t> result;
+    visit_index_format(kind, [&]<class Format>() { result = Format::query(predicate, index); });
+    return result;
+}
+
+// Same as above for an index owned by a vector, the signature the harness was written against
+std::optional<size_t> query_idx(uint32_t predicate, const std::vector<std::byte>& index){
+    return query_idx(predicate, std::span<const std::byte>(index));
+}
+
+// Query the frequencies of a batch of values in the index
+// sorted_predicates must be in ascending order; out[i] receives what query_idx returns for sorted_predicates[i]
+void query_idx_batch(std::span<const uint32_t> sorted_predicates, std::span<const std::byte> index,
+                     std::span<std::optional<size_t>> out){
+    if (index.empty()) {
+        std::fill(out.begin(), out.end(), std::nullopt);
+        return;
+    }
+
+    // Out-of-range predicates form a prefix and a suffix of the sorted batch
+    size_t begin = 0;
+    size_t end = sorted_predicates.size();
+    if ((static_cast<uint8_t>(index[3]) & kRangeFlag) != 0) {
+        const std::byte* trailer = index.data() + index.size() - kRangeTrailerBytes;
+        begin = std::lower_bound(sorted_predicates.begin(), sorted_predicates.end(), load_u32(trailer)) - sorted_predicates.begin();
+        end = std::upper_bound(sorted_predicates.begin() + begin, sorted_predicates.end(), load_u32(trailer + 4)) - sorted_predicates.begin();
+        std::fill(out.begin(), out.begin() + begin, 0);
+        std::fill(out.begin() + end, out.end(), 0);
+    }
+    const auto predicates = sorted_predicates.subspan(begin, end - begin);
+    const auto results = out.subspan(begin, end - begin);
+
+    const auto kind = static_cast<IndexKind>(static_cast<uint8_t>(index[3]) & kKindMask);
+    if (!visit_index_format(kind, [&]<class Format>() { Format::query_batch(predicates, index, results); })) {
+        std::fill(results.begin(), results.end(), std::nullopt);
+    }
+}
+
+void query_idx_batch(std::span<const uint32_t> sorted_predicates, const std::vector<std::byte>& index,
+                     std::span<std::optional<size_t>> out){
+    query_idx_batch(sorted_predicates, std::span<const std::byte>(index), out);
+}
+
+// Cross-block column index: one dictionary of every distinct value of the column, shared by all
+// blocks, and per dictionary entry the blocks holding it with their counts. A probe resolves
+// all blocks with one dictionary lookup instead of one query_idx call per block.
+// [num_blocks(4B)][num_values(4B)][postings directory offset(4B)][dictionary skip table][dictionary varints]
+// [postings directory: offset of every kSkipStride-th entry's postings (4B each)][postings]
+// Postings of an entry: per block holding it, varint(block gap << 2 | more postings << 1 | count > 1),
+// followed by varint(count - 2) if the count is above 1
+constexpr size_t kColumnHeaderBytes = 12;
+
+// Build a column index over all blocks of a column
+// Returns empty vector if it is not cost-effective, or does not beat separate build_idx
+// indexes of the blocks (which is the case when blocks share few values)
+std::vector<std::byte> build_column_idx(std::span<const std::span<const uint32_t>> blocks, Parameters config){
+    struct Posting {
+        uint32_t value;
+        uint32_t block;
+        uint32_t count;
+    };
+    std::vector<Posting> postings;
+    std::vector<uint32_t> sorted;
+    std::vector<uint32_t> scratch;
+    std::vector<Item> items;
+    for (size_t block = 0; block < blocks.size(); block++) {
+        sorted.assign(blocks[block].begin(), blocks[block].end());
+        radix_sort(sorted, scratch);
+        run_length_count(sorted, items);
+        for (const auto& [value, count] : items) {
+            postings.push_back({value, static_cast<uint32_t>(block), count});
+        }
+    }
+    // Blocks were appended in order, so a stable sort keeps every value's postings by block
+    std::ranges::stable_sort(postings, {}, &Posting::value);
+
+    size_t num_values = 0;
+    for (size_t i = 0; i < postings.size(); i++) {
+        num_values += i == 0 || postings[i].value != postings[i - 1].value;
+    }
+    if (num_values > UINT32_MAX || blocks.size() > (UINT32_MAX >> 2)) {
+        return {};
+    }
+
+    const size_t num_stripes = (num_values + kSkipStride - 1) / kSkipStride;
+    std::vector<std::byte> index(kColumnHeaderBytes + num_stripes * (kSkipEntryBytes + sizeof(uint32_t)) +
+                                 (num_values + 2 * postings.size()) * kMaxVarintBytes);
+    store_u32(index.data(), static_cast<uint32_t>(blocks.size()));
+    store_u32(index.data() + 4, static_cast<uint32_t>(num_values));
+
+    // Dictionary: varint stripes, so find_in_stripes yields an entry's position
+    size_t offset = kColumnHeaderBytes + num_stripes * kSkipEntryBytes;
+    size_t entry = 0;
+    for (size_t i = 0; i < postings.size(); i++) {
+        if (i != 0 && postings[i].value == postings[i - 1].value) {
+            continue;
+        }
+        if (entry % kSkipStride == 0) {
+            std::byte* skip_entry = index.data() + kColumnHeaderBytes + entry / kSkipStride * kSkipEntryBytes;
+            store_u32(skip_entry, postings[i].value);
+            store_u32(skip_entry + 4, static_cast<uint32_t>(offset));
+        } else {
+            offset += encode_varint(postings[i].value - postings[i - 1].value, index.data() + offset);
+        }
+        entry++;
+    }
+
+    const size_t directory_offset = offset;
+    store_u32(index.data() + 8, static_cast<uint32_t>(directory_offset));
+    offset += num_stripes * sizeof(uint32_t);
+    entry = 0;
+    for (size_t i = 0; i < postings.size();) {
+        size_t run_end = i + 1;
+        while (run_end < postings.size() && postings[run_end].value == postings[i].value) {
+            run_end++;
+        }
+        if (entry % kSkipStride == 0) {
+            store_u32(index.data() + directory_offset + entry / kSkipStride * sizeof(uint32_t), static_cast<uint32_t>(offset));
+        }
+        uint32_t prev_block = 0;
+        for (size_t p = i; p < run_end; p++) {
+            const uint32_t word = (postings[p].block - prev_block) << 2 | (p + 1 < run_end) << 1 | (postings[p].count > 1);
+            offset += encode_varint(word, index.data() + offset);
+            if (postings[p].count > 1) {
+                offset += encode_varint(postings[p].count - 2, index.data() + offset);
+            }
+            prev_block = postings[p].block;
+        }
+        entry++;
+        i = run_end;
+    }
+    index.resize(offset);
+
+    const CostModel model(config);
+    const double benefit = model.net_benefit(model.probes * static_cast<double>(blocks.size()), index.size());
+    thread_local IndexBuilder builder;
+    double per_block_benefit = 0.0;
+    for (const auto block : blocks) {
+        builder.build(block, config);
+        per_block_benefit += builder.benefit();
+    }
+    if (benefit <= 0.0 || benefit <= per_block_benefit) {
+        return {};  // Index too large, not worth the storage cost
+    }
+    index.shrink_to_fit();
+    return index;
+}
+
+// Query the frequency of a value in every block of a column index
+// counts[block] receives what query_idx would return for that block: nullopt if no index,
+// 0 if the value does not occur in the block, otherwise its count
+void query_column_idx(uint32_t predicate, const std::vector<std::byte>& column_index, std::span<std::optional<size_t>> counts){
+    if (column_index.empty()) {
+        std::fill(counts.begin(), counts.end(), std::nullopt);
+        return;
+    }
+    std::fill(counts.begin(), counts.end(), 0);
+
+    const uint32_t num_values = load_u32(column_index.data() + 4);
+    const auto entry = find_in_stripes(predicate, column_index, kColumnHeaderBytes, num_values);
+    if (!entry) {
+        return;
+    }
+
+    // Land on the stripe's postings, then skip the postings of the entries before this one
+    const size_t directory_offset = load_u32(column_index.data() + 8);
+    size_t offset = load_u32(column_index.data() + directory_offset + *entry / kSkipStride * sizeof(uint32_t));
+    for (size_t k = 0; k < *entry % kSkipStride; k++) {
+        uint32_t word;
+        do {
+            word = decode_varint(column_index.data(), offset);
+            if ((word & 1) != 0) {
+                // Column indexes have no kind byte or range trailer, so the bound is their size
+                offset = skip_varints(column_index.data(), column_index.data() + column_index.size(), offset, 1);
+            }
+        } while ((word & 2) != 0);
+    }
+
+    uint32_t block = 0;
+    uint32_t word;
+    do {
+        word = decode_varint(column_index.data(), offset);
+        block += word >> 2;
+        counts[block] = (word & 1) != 0 ? decode_varint(column_index.data(), offset) + 2 : 1;
+    } while ((word & 2) != 0);
 }
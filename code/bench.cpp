@@ -0,0 +1,338 @@
+// Microbenchmarks of build_idx and query_idx over synthetic blocks
+// Usage: ./bench.out [f_a f_s] [--formats | --check], prints one JSON document to stdout
+// By default every row measures the index build_idx picks for a block. --formats builds every
+// block as every index format through build_idx_as and measures them side by side, next to the
+// kind build_idx picks. --check builds the same indexes and checks query_idx and query_idx_batch
+// against the block's exact counts, and that build_global_idx stores something under a budget that
+// fits a worthwhile option; exits with 1 on a failed check. Built with -DCOUNT_FULL_FRAME_UNPACKS, as
+// make check-formats does, it also fails PFOR blocks whose full frames never take the unrolled unpack.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "User.hpp"
+#include "Parameters.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Every measurement repeats until it ran for at least this long
+constexpr double kMinSeconds = 0.2;
+constexpr size_t kProbesPerKind = 4096;
+constexpr size_t kZipfDomain = 100000;
+constexpr double kZipfExponent = 1.1;
+constexpr uint32_t kLowCardinality = 16;
+
+constexpr const char* kDistributions[] = {"uniform", "zipf", "sorted", "low_cardinality"};
+constexpr size_t kChunkSizes[] = {4096, 32768, 131072};
+
+// Every format the builder writes, Striped once per value codec
+struct Format {
+    const char* name;
+    IndexKind kind;
+    std::optional<ValueCodec> codec;
+};
+
+const Format kFormats[] = {
+    {"striped_varint", IndexKind::Striped, ValueCodec::Varint},
+    {"striped_stream_vbyte", IndexKind::Striped, ValueCodec::StreamVByte},
+    {"striped_pfor", IndexKind::Striped, ValueCodec::Pfor},
+    {"fuse8", IndexKind::Fuse8, std::nullopt},
+    {"fuse16", IndexKind::Fuse16, std::nullopt},
+    {"hybrid8", IndexKind::Hybrid8, std::nullopt},
+    {"hybrid16", IndexKind::Hybrid16, std::nullopt},
+    {"range", IndexKind::Range, std::nullopt},
+    {"eytzinger", IndexKind::Eytzinger, std::nullopt},
+    {"perfect_hash", IndexKind::PerfectHash, std::nullopt},
+    {"roaring", IndexKind::Roaring, std::nullopt},
+};
+
+std::vector<uint32_t> make_block(const std::string& distribution, size_t size, std::mt19937& rng){
+    std::vector<uint32_t> block(size);
+    if (distribution == "uniform"){
+        for (auto& value : block){
+            value = rng();
+        }
+    } else if (distribution == "zipf"){
+        std::vector<double> cdf(kZipfDomain);
+        double sum = 0.0;
+        for (size_t rank = 0; rank != kZipfDomain; rank++){
+            sum += 1.0 / std::pow(static_cast<double>(rank + 1), kZipfExponent);
+            cdf[rank] = sum;
+        }
+        // Spread the ranks over the domain so frequent values are not all small
+        const uint32_t stride = rng() | 1;
+        std::uniform_real_distribution<double> uniform(0.0, sum);
+        for (auto& value : block){
+            const size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+            value = static_cast<uint32_t>(rank) * stride;
+        }
+    } else if (distribution == "sorted"){
+        uint32_t value = rng() % 1000;
+        for (auto& v : block){
+            value += rng() % 4;
+            v = value;
+        }
+    } else {
+        std::vector<uint32_t> domain(kLowCardinality);
+        for (auto& value : domain){
+            value = rng();
+        }
+        for (auto& value : block){
+            value = domain[rng() % kLowCardinality];
+        }
+    }
+    return block;
+}
+
+// Probe predicates that occur in the block, are absent inside its value range, or lie outside it
+struct Probes {
+    std::vector<uint32_t> hit;
+    std::vector<uint32_t> miss;
+    std::vector<uint32_t> out_of_range;
+};
+
+Probes make_probes(const std::vector<uint32_t>& block, std::mt19937& rng){
+    std::vector<uint32_t> distinct = block;
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    const uint32_t min = distinct.front();
+    const uint32_t max = distinct.back();
+
+    Probes probes;
+    for (size_t i = 0; i != kProbesPerKind; i++){
+        probes.hit.push_back(block[rng() % block.size()]);
+    }
+    // Dense blocks may have no gaps; give up after a bounded number of draws
+    for (size_t attempt = 0; probes.miss.size() != kProbesPerKind && attempt != 64 * kProbesPerKind; attempt++){
+        const uint32_t value = min + static_cast<uint32_t>(rng() % (static_cast<uint64_t>(max - min) + 1));
+        if (!std::binary_search(distinct.begin(), distinct.end(), value)){
+            probes.miss.push_back(value);
+        }
+    }
+    for (size_t i = 0; i != kProbesPerKind && (min != 0 || max != UINT32_MAX); i++){
+        probes.out_of_range.push_back(max != UINT32_MAX ? max + 1 + rng() % (UINT32_MAX - max) : rng() % min);
+    }
+    return probes;
+}
+
+// Run f until kMinSeconds have passed; returns seconds per call
+template <class F>
+double time_per_call(F&& f){
+    size_t calls = 0;
+    const auto start = Clock::now();
+    double elapsed = 0.0;
+    do {
+        f();
+        calls++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < kMinSeconds);
+    return elapsed / static_cast<double>(calls);
+}
+
+// Nanoseconds per query_idx call over probes, or -1 if there are none
+double probe_latency(const std::vector<uint32_t>& probes, const std::vector<std::byte>& index, size_t& checksum){
+    if (probes.empty()){
+        return -1.0;
+    }
+    const double seconds = time_per_call([&]{
+        for (const uint32_t predicate : probes){
+            checksum += query_idx(predicate, index).value_or(1);
+        }
+    });
+    return seconds * 1e9 / static_cast<double>(probes.size());
+}
+
+// Index bytes, build throughput and probe latencies of one index, as JSON members
+void write_measurements(const std::vector<uint32_t>& block, const Probes& probes, const std::vector<std::byte>& index,
+                        double build_seconds, size_t& checksum){
+    const double hit_ns = probe_latency(probes.hit, index, checksum);
+    const double miss_ns = probe_latency(probes.miss, index, checksum);
+    const double out_of_range_ns = probe_latency(probes.out_of_range, index, checksum);
+    std::cout << ", \"index_bytes\": " << index.size()
+              << ", \"build_values_per_s\": " << static_cast<double>(block.size()) / build_seconds
+              << ", \"hit_ns_per_probe\": " << hit_ns
+              << ", \"miss_ns_per_probe\": " << miss_ns
+              << ", \"out_of_range_ns_per_probe\": " << out_of_range_ns;
+}
+
+// --formats: per block, the kind build_idx picks and a row for every format that could be built
+void compare_formats(const Parameters& p){
+    std::mt19937 rng(42);
+    size_t checksum = 0;
+    bool first = true;
+    std::cout << "{\n  \"f_a\": " << p.f_a << ",\n  \"f_s\": " << p.f_s << ",\n  \"blocks\": [";
+    for (const std::string distribution : kDistributions){
+        for (const size_t chunk_size : kChunkSizes){
+            const auto block = make_block(distribution, chunk_size, rng);
+            const auto probes = make_probes(block, rng);
+            const auto selected = build_idx(block, p);
+            std::cout << (first ? "\n" : ",\n") << "    {\"distribution\": \"" << distribution << "\""
+                      << ", \"chunk_size\": " << chunk_size
+                      << ", \"selected_kind\": " << (selected.empty() ? -1 : static_cast<uint8_t>(selected[3]) & kKindMask)
+                      << ", \"formats\": [";
+            bool first_format = true;
+            for (const auto& format : kFormats){
+                std::vector<std::byte> index;
+                const double build_seconds = time_per_call([&]{ index = build_idx_as(block, p, format.kind, format.codec); });
+                if (index.empty()){
+                    continue;
+                }
+                std::cout << (first_format ? "\n" : ",\n") << "      {\"format\": \"" << format.name << "\"";
+                write_measurements(block, probes, index, build_seconds, checksum);
+                std::cout << "}";
+                first_format = false;
+            }
+            std::cout << "\n    ]}";
+            first = false;
+        }
+    }
+    std::cout << "\n  ],\n  \"checksum\": " << checksum << "\n}" << std::endl;
+}
+
+// Number of probes whose answer from index contradicts the exact counts of block
+// A filter may answer unknown, every other answer must be the exact count; the batch answers
+// must equal the single ones.
+size_t check_index(const std::vector<uint32_t>& block, const Probes& probes, const std::vector<std::byte>& index, size_t& num_probes){
+    std::vector<uint32_t> sorted_block = block;
+    std::sort(sorted_block.begin(), sorted_block.end());
+    std::vector<uint32_t> predicates = probes.hit;
+    predicates.insert(predicates.end(), probes.miss.begin(), probes.miss.end());
+    predicates.insert(predicates.end(), probes.out_of_range.begin(), probes.out_of_range.end());
+    std::sort(predicates.begin(), predicates.end());
+
+    std::vector<std::optional<size_t>> batch(predicates.size());
+    query_idx_batch(predicates, index, batch);
+    size_t num_wrong = 0;
+    for (size_t i = 0; i != predicates.size(); i++){
+        const auto range = std::equal_range(sorted_block.begin(), sorted_block.end(), predicates[i]);
+        const auto expected = static_cast<size_t>(range.second - range.first);
+        const auto answer = query_idx(predicates[i], index);
+        num_wrong += (answer && *answer != expected) || batch[i] != answer;
+    }
+    num_probes += predicates.size();
+    return num_wrong;
+}
+
+size_t distinct_values(std::vector<uint32_t> block){
+    std::sort(block.begin(), block.end());
+    return static_cast<size_t>(std::unique(block.begin(), block.end()) - block.begin());
+}
+
+// Whether build_global_idx gives block storage under the smallest budget that fits an option worth
+// more than its bytes, which it must: the first step of the hull within that budget is as good
+bool check_budget(const std::vector<uint32_t>& block, const Parameters& p){
+    IndexBuilder builder;
+    const CostModel model(p);
+    size_t budget = 0;
+    for (const auto& option : builder.options(block, p)){
+        const double ratio = option.skips * model.f_a / static_cast<double>(option.index.size());
+        if (ratio > model.f_s / 1024.0 && (budget == 0 || option.index.size() < budget)){
+            budget = option.index.size();
+        }
+    }
+    if (budget == 0){
+        return true;
+    }
+    const std::span<const uint32_t> blocks[] = {block};
+    const auto indexes = build_global_idx(blocks, p, budget);
+    return !indexes[0].empty() && indexes[0].size() <= budget;
+}
+
+// --check: one row per block and format, with the bytes of the forced build or built: false
+int check_formats(const Parameters& p){
+    std::mt19937 rng(42);
+    size_t num_wrong = 0;
+    size_t num_probes = 0;
+    size_t num_budget_failures = 0;
+    size_t num_slow_unpacks = 0;
+    bool first = true;
+    std::cout << "{\n  \"f_a\": " << p.f_a << ",\n  \"f_s\": " << p.f_s << ",\n  \"checks\": [";
+    for (const std::string distribution : kDistributions){
+        for (const size_t chunk_size : kChunkSizes){
+            const auto block = make_block(distribution, chunk_size, rng);
+            const auto probes = make_probes(block, rng);
+            num_budget_failures += !check_budget(block, p);
+            for (const auto& format : kFormats){
+                const auto index = build_idx_as(block, p, format.kind, format.codec);
+                std::cout << (first ? "\n" : ",\n") << "    {\"distribution\": \"" << distribution << "\""
+                          << ", \"chunk_size\": " << chunk_size
+                          << ", \"format\": \"" << format.name << "\"";
+                if (index.empty()){
+                    std::cout << ", \"built\": false}";
+                } else {
+#ifdef COUNT_FULL_FRAME_UNPACKS
+                    const size_t unpacks_before = full_frame_unpacks;
+#endif
+                    const size_t wrong = check_index(block, probes, index, num_probes);
+                    num_wrong += wrong;
+                    std::cout << ", \"built\": true, \"index_bytes\": " << index.size() << ", \"wrong\": " << wrong;
+#ifdef COUNT_FULL_FRAME_UNPACKS
+                    // Every probe of a PFOR block with full frames unpacks one of them
+                    if (format.codec == ValueCodec::Pfor && distinct_values(block) > kPforFrame){
+                        const size_t unpacks = full_frame_unpacks - unpacks_before;
+                        num_slow_unpacks += unpacks == 0;
+                        std::cout << ", \"full_frame_unpacks\": " << unpacks;
+                    }
+#endif
+                    std::cout << "}";
+                }
+                first = false;
+            }
+        }
+    }
+    std::cout << "\n  ],\n  \"probes\": " << num_probes << ",\n  \"wrong\": " << num_wrong
+              << ",\n  \"budget_failures\": " << num_budget_failures
+              << ",\n  \"slow_unpacks\": " << num_slow_unpacks << "\n}" << std::endl;
+    return num_wrong == 0 && num_budget_failures == 0 && num_slow_unpacks == 0 ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv){
+    const bool positional = argc >= 3 && std::string(argv[1]).rfind("--", 0) != 0;
+    std::string f_a = positional ? argv[1] : "1";
+    std::string f_s = positional ? argv[2] : "1";
+    std::string name = "bench";
+    Parameters p(f_a.data(), f_s.data(), name.data());
+    const int first_flag = positional ? 3 : 1;
+    if (argc > first_flag && std::string(argv[first_flag]) == "--check"){
+        return check_formats(p);
+    }
+    if (argc > first_flag && std::string(argv[first_flag]) == "--formats"){
+        compare_formats(p);
+        return 0;
+    }
+
+    std::mt19937 rng(42);
+    size_t checksum = 0;
+    bool first = true;
+
+    std::cout << "{\n  \"f_a\": " << p.f_a << ",\n  \"f_s\": " << p.f_s << ",\n  \"benchmarks\": [";
+    for (const std::string distribution : kDistributions){
+        for (const size_t chunk_size : kChunkSizes){
+            const auto block = make_block(distribution, chunk_size, rng);
+            const auto probes = make_probes(block, rng);
+
+            std::vector<std::byte> index;
+            const double build_seconds = time_per_call([&]{ index = build_idx(block, p); });
+            const int kind = index.empty() ? -1 : static_cast<uint8_t>(index[3]) & kKindMask;
+
+            std::cout << (first ? "\n" : ",\n") << "    {\"distribution\": \"" << distribution << "\""
+                      << ", \"chunk_size\": " << chunk_size
+                      << ", \"kind\": " << kind;
+            write_measurements(block, probes, index, build_seconds, checksum);
+            std::cout << "}";
+            first = false;
+        }
+    }
+    std::cout << "\n  ],\n  \"checksum\": " << checksum << "\n}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Synthetic data and query generator writing the DataFile/QueryFile layout of FileUtils.hpp
+// Usage: ./gen.out <prefix> [--chunks <n>] [--chunk-size <m>] [--queries <k>] [--distinct-ratio <r>]
+//                  [--zipf <s>] [--locality <l>] [--hit-rate <h>] [--seed <seed>]
+// Writes <prefix>.data and <prefix>.query. Chunks are generated and written one at a time,
+// so the output can be far larger than memory.
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+struct GeneratorOptions {
+    std::string prefix;
+    uint64_t num_chunks = 64;
+    uint64_t chunk_size = 131072;
+    uint64_t num_queries = 64;
+    // distinct values per chunk relative to chunk_size
+    double distinct_ratio = 0.5;
+    // Zipf exponent of value frequencies within a chunk, 0 is uniform
+    double zipf = 0.0;
+    // share of a chunk's value domain carried over from the previous chunk
+    double locality = 0.0;
+    // share of queries drawn from values that occur in the data
+    double hit_rate = 0.5;
+    uint64_t seed = 1;
+};
+
+std::optional<GeneratorOptions> parse_options(int argc, char** argv){
+    if (argc < 2){
+        return std::nullopt;
+    }
+    GeneratorOptions options;
+    options.prefix = argv[1];
+    for (int i = 2; i + 1 < argc; i += 2){
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+        if (arg == "--chunks"){
+            options.num_chunks = std::stoull(value);
+        } else if (arg == "--chunk-size"){
+            options.chunk_size = std::stoull(value);
+        } else if (arg == "--queries"){
+            options.num_queries = std::stoull(value);
+        } else if (arg == "--distinct-ratio"){
+            options.distinct_ratio = std::stod(value);
+        } else if (arg == "--zipf"){
+            options.zipf = std::stod(value);
+        } else if (arg == "--locality"){
+            options.locality = std::stod(value);
+        } else if (arg == "--hit-rate"){
+            options.hit_rate = std::stod(value);
+        } else if (arg == "--seed"){
+            options.seed = std::stoull(value);
+        } else {
+            return std::nullopt;
+        }
+    }
+    if (argc % 2 != 0 || options.chunk_size == 0){
+        return std::nullopt;
+    }
+    return options;
+}
+
+// Draws ranks in [0, domain_size) with Zipf(s) frequencies, uniform for s = 0
+class RankSampler {
+public:
+    RankSampler(size_t domain_size, double exponent) : cdf(domain_size) {
+        double sum = 0.0;
+        for (size_t rank = 0; rank != domain_size; rank++){
+            sum += exponent == 0.0 ? 1.0 : 1.0 / std::pow(static_cast<double>(rank + 1), exponent);
+            cdf[rank] = sum;
+        }
+    }
+
+    size_t operator()(std::mt19937_64& rng){
+        std::uniform_real_distribution<double> uniform(0.0, cdf.back());
+        return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin(), cdf.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf;
+};
+
+bool write_u64(std::ofstream& file, uint64_t value){
+    return static_cast<bool>(file.write(reinterpret_cast<const char*>(&value), sizeof(value)));
+}
+
+int main(int argc, char** argv){
+    const auto options = parse_options(argc, argv);
+    if (!options){
+        std::cout << "Usage: ./gen.out <prefix> [--chunks <n>] [--chunk-size <m>] [--queries <k>] [--distinct-ratio <r>] "
+                     "[--zipf <s>] [--locality <l>] [--hit-rate <h>] [--seed <seed>]" << std::endl;
+        return 1;
+    }
+
+    std::mt19937_64 rng(options->seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    const size_t domain_size = std::max<size_t>(1, static_cast<size_t>(std::llround(options->distinct_ratio * options->chunk_size)));
+    RankSampler sample_rank(domain_size, options->zipf);
+
+    std::ofstream data(options->prefix + ".data", std::ios::binary);
+    if (!data || !write_u64(data, options->num_chunks) || !write_u64(data, options->chunk_size)){
+        std::cerr << "Failed to write file: " << options->prefix << ".data" << std::endl;
+        return 2;
+    }
+
+    // Hit queries are reservoir-sampled from the generated values, so the data is never held whole
+    const auto num_hits = static_cast<uint64_t>(std::llround(std::clamp(options->hit_rate, 0.0, 1.0) * options->num_queries));
+    std::vector<uint32_t> hits;
+    uint64_t values_seen = 0;
+
+    std::vector<uint32_t> domain(domain_size);
+    std::vector<uint32_t> chunk(options->chunk_size);
+    for (auto& value : domain){
+        value = static_cast<uint32_t>(rng());
+    }
+    for (uint64_t j = 0; j != options->num_chunks; j++){
+        if (j != 0){
+            // Drift the domain: every value survives into the next chunk with probability locality
+            for (auto& value : domain){
+                if (coin(rng) >= options->locality){
+                    value = static_cast<uint32_t>(rng());
+                }
+            }
+        }
+        for (auto& value : chunk){
+            value = domain[sample_rank(rng)];
+            if (hits.size() < num_hits){
+                hits.push_back(value);
+            } else if (num_hits != 0){
+                const uint64_t slot = rng() % (values_seen + 1);
+                if (slot < num_hits){
+                    hits[slot] = value;
+                }
+            }
+            values_seen++;
+        }
+        if (!data.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(uint32_t))){
+            std::cerr << "Failed to write file: " << options->prefix << ".data" << std::endl;
+            return 2;
+        }
+    }
+
+    std::ofstream queries(options->prefix + ".query", std::ios::binary);
+    if (!queries || !write_u64(queries, options->num_queries)){
+        std::cerr << "Failed to write file: " << options->prefix << ".query" << std::endl;
+        return 2;
+    }
+    std::vector<uint32_t> predicates = hits;
+    while (predicates.size() < options->num_queries){
+        predicates.push_back(static_cast<uint32_t>(rng()));
+    }
+    std::shuffle(predicates.begin(), predicates.end(), rng);
+    if (!queries.write(reinterpret_cast<const char*>(predicates.data()), predicates.size() * sizeof(uint32_t))){
+        std::cerr << "Failed to write file: " << options->prefix << ".query" << std::endl;
+        return 2;
+    }
+    return 0;
+}
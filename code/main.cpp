@@ -1,57 +1,890 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
+#include <latch>
+#include <memory>
+#include <optional>
+#include <random>
+#include <semaphore>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "User.hpp"
 #include "Parameters.hpp"
 #include "FileUtils.hpp"
-#include <cassert>
+#include "ThreadPool.hpp"
+#include "Postings.hpp"
+#include "IndexStore.hpp"
+#include "ChunkStream.hpp"
+#include "Instrumentation.hpp"
+#include "QueryService.hpp"
+#include <cstdlib>
 
 size_t eval(std::span<const uint32_t> values, uint32_t predicate){
-    size_t result = 0;
-    for (const auto val : values){
-        result += val == predicate;
+    return count_equal(values, predicate);
+}
+
+// Answers are always checked in debug builds; NDEBUG builds only check them with --verify
+#ifdef NDEBUG
+bool verify_answers = false;
+#else
+bool verify_answers = true;
+#endif
+
+void check_answer(size_t answer, size_t expected, uint32_t predicate, size_t chunk){
+    if (answer != expected){
+        std::cerr << "wrong answer for " << predicate << " in chunk " << chunk << ": "
+                  << answer << " instead of " << expected << std::endl;
+        std::abort();
     }
-    return result;
 }
 
-int main(int argc, char** argv){
-    if (argc != 4){
-        std::cout << "Usage: ./main <f_a> <f_s> <filename>" << std::endl;
-        return 1;
+// Optional flags following the three positional arguments
+struct HarnessOptions {
+    // Worker threads of the parallel driver, unset runs the serial driver
+    std::optional<size_t> num_threads;
+    // Probe every chunk with the whole sorted query batch through query_idx_batch
+    bool batch = false;
+    // Price indexes against a profile of the query file instead of the built-in workload guess
+    bool workload = false;
+    // Override the number of queries expected per block
+    std::optional<double> queries_per_block;
+    // Per-thread budget of the decoded-index cache in KiB
+    size_t cache_kib = 0;
+    // Replace the per-chunk indexes by one cross-chunk column index
+    bool column = false;
+    // After the scored run, answer every query from inverted query postings and time that apart
+    bool inverted = false;
+    // Check every answer even in NDEBUG builds
+    bool verify = false;
+    // Directory of persisted index stores: reuse a matching store instead of building, or write one
+    std::optional<std::string> store_dir;
+    // Build all per-chunk indexes with build_global_idx, sharing one storage budget in KiB if set
+    bool global = false;
+    std::optional<size_t> budget_kib;
+    // Read, index and query the data chunk by chunk with this many chunks in flight, 0 is off
+    size_t stream_depth = 0;
+    // Print per-phase timings, query_idx latency percentiles and index sizes as JSON after the score
+    bool instrument = false;
+    // Serve this many requests of request_size predicates after the build instead of the query phase
+    size_t service_requests = 0;
+    size_t request_size = 16;
+};
+
+// Parallel driver tiles the query x chunk matrix so a tile's indexes stay cache resident
+constexpr size_t kQueriesPerTile = 16;
+constexpr size_t kTileIndexBytes = 256 * 1024;
+
+std::optional<HarnessOptions> parse_options(int argc, char** argv){
+    HarnessOptions options;
+    for (int i = 4; i < argc; i++){
+        const std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc){
+            size_t num_threads = std::stoul(argv[++i]);
+            if (num_threads == 0){
+                num_threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            options.num_threads = num_threads;
+        } else if (arg == "--batch"){
+            options.batch = true;
+        } else if (arg == "--workload"){
+            options.workload = true;
+        } else if (arg == "--queries-per-block" && i + 1 < argc){
+            options.queries_per_block = std::stod(argv[++i]);
+        } else if (arg == "--verify"){
+            options.verify = true;
+        } else if (arg == "--store" && i + 1 < argc){
+            options.store_dir = argv[++i];
+        } else if (arg == "--global"){
+            options.global = true;
+        } else if (arg == "--budget" && i + 1 < argc){
+            options.global = true;
+            options.budget_kib = std::stoul(argv[++i]);
+        } else if (arg == "--stream" && i + 1 < argc){
+            options.stream_depth = std::stoul(argv[++i]);
+            if (options.stream_depth == 0){
+                return std::nullopt;
+            }
+        } else if (arg == "--service" && i + 1 < argc){
+            options.service_requests = std::stoul(argv[++i]);
+        } else if (arg == "--request-size" && i + 1 < argc){
+            options.request_size = std::stoul(argv[++i]);
+            if (options.request_size == 0){
+                return std::nullopt;
+            }
+        } else if (arg == "--instrument"){
+            options.instrument = true;
+        } else if (arg == "--inverted"){
+            options.inverted = true;
+        } else if (arg == "--column"){
+            options.column = true;
+        } else if (arg == "--cache" && i + 1 < argc){
+            options.cache_kib = std::stoul(argv[++i]);
+        } else {
+            return std::nullopt;
+        }
     }
-    Parameters p(argv[1], argv[2], argv[3]);
-    InMemoryFile dataFile(p.filename + ".data");
-    InMemoryFile queryFile(p.filename + ".query");
-    
-    const auto* data = reinterpret_cast<const DataFile*>(dataFile.begin());
-    const auto* queries = reinterpret_cast<const QueryFile*>(queryFile.begin());
+    // The service answers from per-chunk indexes over the mapped data
+    if (options.service_requests && (options.column || options.stream_depth)){
+        return std::nullopt;
+    }
+    // Streaming builds each chunk's index with build_idx and probes it with single queries right away
+    if (options.stream_depth && (options.batch || options.column || options.inverted || options.global || options.store_dir)){
+        return std::nullopt;
+    }
+    return options;
+}
 
-    std::vector<std::vector<std::byte>> indexes(data->num_chunks);
+// Per-chunk indexes as the query drivers see them, either owned by the build or mapped from a store
+using IndexViews = std::vector<std::span<const std::byte>>;
+
+size_t build_indexes(const DataFile* data, const Parameters& p, std::vector<std::vector<std::byte>>& indexes){
     size_t storage_size = 0;
     for (size_t i=0; i!=data->num_chunks; i++){
         indexes[i] = build_idx(data->getChunk(i), p);
         storage_size += indexes[i].size();
     }
-    storage_size = (storage_size + 1023) / 1024;
+    return storage_size;
+}
 
+size_t evaluate(const DataFile* data, const QueryFile* queries, const IndexViews& indexes){
     size_t num_skips = 0;
     for (size_t i=0; i!=queries->num_queries; i++){
         uint32_t predicate = queries->values[i];
         for (size_t j=0; j!=data->num_chunks; j++){
             auto user_result = query_idx(predicate, indexes[j]);
             if (user_result.has_value()){
-                assert(user_result.value() == eval(data->getChunk(j), predicate));
+                if (verify_answers){
+                    check_answer(user_result.value(), eval(data->getChunk(j), predicate), predicate, j);
+                }
                 num_skips++;
             }
         }
     }
+    return num_skips;
+}
+
+size_t build_indexes_parallel(ThreadPool& pool, const DataFile* data, const Parameters& p,
+                              std::vector<std::vector<std::byte>>& indexes){
+    pool.parallel_for(data->num_chunks, [&](size_t i, size_t){
+        indexes[i] = build_idx(data->getChunk(i), p);
+    });
+    size_t storage_size = 0;
+    for (const auto& index : indexes){
+        storage_size += index.size();
+    }
+    return storage_size;
+}
+
+size_t evaluate_parallel(ThreadPool& pool, const DataFile* data, const QueryFile* queries,
+                         const IndexViews& indexes){
+    // Group consecutive chunks until their indexes fill a tile
+    std::vector<size_t> chunk_bounds = {0};
+    size_t tile_bytes = 0;
+    for (size_t j=0; j!=data->num_chunks; j++){
+        if (tile_bytes != 0 && tile_bytes + indexes[j].size() > kTileIndexBytes){
+            chunk_bounds.push_back(j);
+            tile_bytes = 0;
+        }
+        tile_bytes += indexes[j].size();
+    }
+    chunk_bounds.push_back(data->num_chunks);
+
+    const size_t num_chunk_tiles = chunk_bounds.size() - 1;
+    const size_t num_query_tiles = (queries->num_queries + kQueriesPerTile - 1) / kQueriesPerTile;
+
+    struct alignas(64) Counter {
+        size_t value = 0;
+    };
+    std::vector<Counter> num_skips_per_thread(pool.size());
+
+    pool.parallel_for(num_query_tiles * num_chunk_tiles, [&](size_t tile, size_t worker_id){
+        const size_t query_begin = (tile / num_chunk_tiles) * kQueriesPerTile;
+        const size_t query_end = std::min<size_t>(query_begin + kQueriesPerTile, queries->num_queries);
+        const size_t chunk_begin = chunk_bounds[tile % num_chunk_tiles];
+        const size_t chunk_end = chunk_bounds[tile % num_chunk_tiles + 1];
+
+        size_t num_skips = 0;
+        for (size_t i=query_begin; i!=query_end; i++){
+            uint32_t predicate = queries->values[i];
+            for (size_t j=chunk_begin; j!=chunk_end; j++){
+                auto user_result = query_idx(predicate, indexes[j]);
+                if (user_result.has_value()){
+                    if (verify_answers){
+                        check_answer(user_result.value(), eval(data->getChunk(j), predicate), predicate, j);
+                    }
+                    num_skips++;
+                }
+            }
+        }
+        num_skips_per_thread[worker_id].value += num_skips;
+    });
+
+    size_t num_skips = 0;
+    for (const auto& counter : num_skips_per_thread){
+        num_skips += counter.value;
+    }
+    return num_skips;
+}
+
+// Profile the queries every block is probed with
+// queries_per_block replaces the query count; the frequency sketch is only kept with the full profile
+std::shared_ptr<const WorkloadProfile> profile_workload(const QueryFile* queries, const HarnessOptions& options){
+    if (!options.workload && !options.queries_per_block){
+        return nullptr;
+    }
+    auto profile = std::make_shared<WorkloadProfile>(options.queries_per_block.value_or(queries->num_queries));
+    if (options.workload){
+        for (size_t i=0; i!=queries->num_queries; i++){
+            profile->add(queries->values[i]);
+        }
+    }
+    return profile;
+}
+
+// Query values in ascending order, with the original position of every sorted value
+struct SortedQueries {
+    std::vector<uint32_t> values;
+    std::vector<size_t> order;
+};
+
+SortedQueries sort_queries(const QueryFile* queries){
+    SortedQueries sorted;
+    sorted.order.resize(queries->num_queries);
+    for (size_t i=0; i!=queries->num_queries; i++){
+        sorted.order[i] = i;
+    }
+    std::stable_sort(sorted.order.begin(), sorted.order.end(), [&](size_t a, size_t b){
+        return queries->values[a] < queries->values[b];
+    });
+    sorted.values.reserve(queries->num_queries);
+    for (size_t i : sorted.order){
+        sorted.values.push_back(queries->values[i]);
+    }
+    return sorted;
+}
+
+// Probe one chunk with the sorted batch; results land in results in original query order
+size_t evaluate_chunk_batch(const DataFile* data, const QueryFile* queries, const SortedQueries& sorted,
+                            std::span<const std::byte> index, size_t j,
+                            std::vector<std::optional<size_t>>& sorted_results, std::vector<std::optional<size_t>>& results){
+    query_idx_batch(sorted.values, index, sorted_results);
+    for (size_t k=0; k!=sorted.order.size(); k++){
+        results[sorted.order[k]] = sorted_results[k];
+    }
+
+    size_t num_skips = 0;
+    for (size_t i=0; i!=queries->num_queries; i++){
+        if (results[i].has_value()){
+            if (verify_answers){
+                check_answer(results[i].value(), eval(data->getChunk(j), queries->values[i]), queries->values[i], j);
+            }
+            num_skips++;
+        }
+    }
+    return num_skips;
+}
+
+size_t evaluate_batch(const DataFile* data, const QueryFile* queries, const IndexViews& indexes){
+    const SortedQueries sorted = sort_queries(queries);
+    std::vector<std::optional<size_t>> sorted_results(queries->num_queries);
+    std::vector<std::optional<size_t>> results(queries->num_queries);
+
+    size_t num_skips = 0;
+    for (size_t j=0; j!=data->num_chunks; j++){
+        num_skips += evaluate_chunk_batch(data, queries, sorted, indexes[j], j, sorted_results, results);
+    }
+    return num_skips;
+}
+
+size_t evaluate_batch_parallel(ThreadPool& pool, const DataFile* data, const QueryFile* queries,
+                               const IndexViews& indexes){
+    const SortedQueries sorted = sort_queries(queries);
+
+    struct alignas(64) WorkerState {
+        std::vector<std::optional<size_t>> sorted_results;
+        std::vector<std::optional<size_t>> results;
+        size_t num_skips = 0;
+    };
+    std::vector<WorkerState> states(pool.size());
+    for (auto& state : states){
+        state.sorted_results.resize(queries->num_queries);
+        state.results.resize(queries->num_queries);
+    }
+
+    pool.parallel_for(data->num_chunks, [&](size_t j, size_t worker_id){
+        auto& state = states[worker_id];
+        state.num_skips += evaluate_chunk_batch(data, queries, sorted, indexes[j], j, state.sorted_results, state.results);
+    });
+
+    size_t num_skips = 0;
+    for (const auto& state : states){
+        num_skips += state.num_skips;
+    }
+    return num_skips;
+}
 
-    double normalizer = p.f_a * data->num_chunks * queries->num_queries ;
+std::vector<std::span<const uint32_t>> column_chunks(const DataFile* data){
+    std::vector<std::span<const uint32_t>> chunks;
+    for (size_t j=0; j!=data->num_chunks; j++){
+        chunks.push_back(data->getChunk(j));
+    }
+    return chunks;
+}
+
+// Resolve every query against all chunks at once through the column index
+size_t evaluate_column(ThreadPool* pool, const DataFile* data, const QueryFile* queries, const std::vector<std::byte>& column_index){
+    struct alignas(64) WorkerState {
+        std::vector<std::optional<size_t>> counts;
+        size_t num_skips = 0;
+    };
+    std::vector<WorkerState> states(pool ? pool->size() : 1);
+    for (auto& state : states){
+        state.counts.resize(data->num_chunks);
+    }
+
+    auto evaluate_query = [&](size_t i, size_t worker_id){
+        auto& state = states[worker_id];
+        uint32_t predicate = queries->values[i];
+        query_column_idx(predicate, column_index, state.counts);
+        for (size_t j=0; j!=data->num_chunks; j++){
+            if (state.counts[j].has_value()){
+                if (verify_answers){
+                    check_answer(state.counts[j].value(), eval(data->getChunk(j), predicate), predicate, j);
+                }
+                state.num_skips++;
+            }
+        }
+    };
+    if (pool){
+        pool->parallel_for(queries->num_queries, evaluate_query);
+    } else {
+        for (size_t i=0; i!=queries->num_queries; i++){
+            evaluate_query(i, 0);
+        }
+    }
+
+    size_t num_skips = 0;
+    for (const auto& state : states){
+        num_skips += state.num_skips;
+    }
+    return num_skips;
+}
+
+// Answer every query from the query postings alone: its non-zero chunks are read in O(hits) and
+// every other chunk answers 0 without probing an index. Returns the sum of all answers; with
+// verification on, every index that knows a count must agree with the postings.
+size_t answer_from_postings(ThreadPool* pool, const QueryPostings& postings, const QueryFile* queries,
+                            const IndexViews& indexes){
+    struct alignas(64) WorkerState {
+        std::vector<QueryPostings::Posting> hits;
+        size_t total_count = 0;
+    };
+    std::vector<WorkerState> states(pool ? pool->size() : 1);
+
+    auto answer_query = [&](size_t i, size_t worker_id){
+        auto& state = states[worker_id];
+        uint32_t predicate = queries->values[i];
+        postings.lookup(predicate, state.hits);
+        for (const auto& [chunk, count] : state.hits){
+            state.total_count += count;
+        }
+        if (verify_answers){
+            auto hit = state.hits.begin();
+            for (size_t j=0; j!=indexes.size(); j++){
+                size_t expected = 0;
+                if (hit != state.hits.end() && hit->first == j){
+                    expected = (hit++)->second;
+                }
+                if (auto user_result = query_idx(predicate, indexes[j])){
+                    check_answer(user_result.value(), expected, predicate, j);
+                }
+            }
+        }
+    };
+    if (pool){
+        pool->parallel_for(queries->num_queries, answer_query);
+    } else {
+        for (size_t i=0; i!=queries->num_queries; i++){
+            answer_query(i, 0);
+        }
+    }
+
+    size_t total_count = 0;
+    for (const auto& state : states){
+        total_count += state.total_count;
+    }
+    return total_count;
+}
+
+// Streaming driver: a chunk's index is built and probed with every query as soon as the chunk
+// was read, and its values are released right after, so the data file is never resident whole
+size_t evaluate_streaming(ThreadPool* pool, ChunkStream& stream, const Parameters& p, const QueryFile* queries,
+                          std::vector<std::vector<std::byte>>& indexes){
+    indexes.resize(stream.size());
+    struct alignas(64) Counter {
+        size_t value = 0;
+    };
+    std::vector<Counter> num_skips_per_thread(pool ? pool->size() : 1);
+
+    auto consume = [&](size_t, size_t worker_id){
+        while (const auto chunk = stream.next()){
+            auto& index = indexes[chunk->id];
+            index = build_idx(chunk->values, p);
+            size_t num_skips = 0;
+            for (size_t i=0; i!=queries->num_queries; i++){
+                uint32_t predicate = queries->values[i];
+                auto user_result = query_idx(predicate, index);
+                if (user_result.has_value()){
+                    if (verify_answers){
+                        check_answer(user_result.value(), eval(chunk->values, predicate), predicate, chunk->id);
+                    }
+                    num_skips++;
+                }
+            }
+            stream.release(*chunk);
+            num_skips_per_thread[worker_id].value += num_skips;
+        }
+    };
+    if (pool){
+        pool->parallel_for(pool->size(), consume);
+    } else {
+        consume(0, 0);
+    }
+
+    size_t num_skips = 0;
+    for (const auto& counter : num_skips_per_thread){
+        num_skips += counter.value;
+    }
+    return num_skips;
+}
+
+// Service mode: a producer enqueues requests of Zipf-distributed predicates from the query file
+// and every request runs as a coroutine fanning tiles of chunks out over the pool. Counts of
+// (predicate, chunk) pairs are memoized, so hot predicates skip query_idx after their first request.
+constexpr size_t kServiceChunksPerTile = 8;
+constexpr size_t kServiceCacheSlots = 1 << 16;
+constexpr size_t kServiceInFlightPerThread = 4;
+constexpr double kServiceZipf = 1.0;
+
+struct ServiceContext {
+    ThreadPool& pool;
+    const DataFile* data;
+    const IndexViews& indexes;
+    ResultCache cache{kServiceCacheSlots / ResultCache::kShards};
+    std::counting_semaphore<> in_flight;
+    std::latch finished;
+    // Enqueue-to-completion latency per request id
+    std::vector<uint64_t> latencies;
+    struct alignas(64) Counter {
+        size_t decoded = 0;
+        size_t scanned = 0;
+    };
+    std::vector<Counter> counters;
+    std::atomic<size_t> matches = 0;
+
+    ServiceContext(ThreadPool& pool, const DataFile* data, const IndexViews& indexes, size_t num_requests)
+        : pool(pool), data(data), indexes(indexes),
+          in_flight(static_cast<ptrdiff_t>(pool.size() * kServiceInFlightPerThread)),
+          finished(static_cast<ptrdiff_t>(num_requests)), latencies(num_requests), counters(pool.size()) {}
+
+    size_t count(uint32_t predicate, size_t j, size_t worker_id){
+        if (const auto cached = cache.find(predicate, static_cast<uint32_t>(j))){
+            if (verify_answers){
+                check_answer(*cached, eval(data->getChunk(j), predicate), predicate, j);
+            }
+            return *cached;
+        }
+        auto answer = query_idx(predicate, indexes[j]);
+        if (answer){
+            if (verify_answers){
+                check_answer(*answer, eval(data->getChunk(j), predicate), predicate, j);
+            }
+            counters[worker_id].decoded++;
+        } else {
+            answer = eval(data->getChunk(j), predicate);
+            counters[worker_id].scanned++;
+        }
+        cache.insert(predicate, static_cast<uint32_t>(j), *answer);
+        return *answer;
+    }
+};
+
+// Starts on the dispatching thread and resumes on the pool worker that finishes its last tile
+ServiceTask serve_request(ServiceContext& context, ServiceRequest request){
+    const size_t num_chunks = context.data->num_chunks;
+    const size_t k = request.predicates.size();
+    const size_t num_tiles = (num_chunks + kServiceChunksPerTile - 1) / kServiceChunksPerTile;
+    std::vector<size_t> partial(num_tiles * k);
+    auto tile = [&](size_t t, size_t worker_id){
+        const size_t end = std::min(num_chunks, (t + 1) * kServiceChunksPerTile);
+        for (size_t j = t * kServiceChunksPerTile; j != end; j++){
+            for (size_t q=0; q!=k; q++){
+                partial[t * k + q] += context.count(request.predicates[q], j, worker_id);
+            }
+        }
+    };
+    co_await fan_out(context.pool, num_tiles, tile);
+
+    size_t matches = 0;
+    for (const size_t count : partial){
+        matches += count;
+    }
+    context.matches.fetch_add(matches, std::memory_order_relaxed);
+    context.latencies[request.id] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - request.enqueued).count();
+    context.in_flight.release();
+    context.finished.count_down();
+}
+
+void run_service(ThreadPool& pool, const DataFile* data, const QueryFile* queries, const IndexViews& indexes,
+                 const HarnessOptions& options, std::ostream& out){
+    const size_t num_requests = options.service_requests;
+    ServiceContext context(pool, data, indexes, num_requests);
+    RequestQueue queue(pool.size() * kServiceInFlightPerThread);
+
+    // Query file positions ranked by a Zipf CDF, so a few predicates make up most requests
+    std::vector<double> cdf(queries->num_queries);
+    double sum = 0.0;
+    for (size_t rank=0; rank!=cdf.size(); rank++){
+        sum += 1.0 / std::pow(static_cast<double>(rank + 1), kServiceZipf);
+        cdf[rank] = sum;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::thread producer([&]{
+        std::mt19937_64 rng(1);
+        std::uniform_real_distribution<double> uniform(0.0, sum);
+        for (size_t id=0; id!=num_requests; id++){
+            ServiceRequest request{id, {}, {}};
+            for (size_t q=0; q!=options.request_size && !cdf.empty(); q++){
+                const size_t rank = std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin(), cdf.size() - 1);
+                request.predicates.push_back(queries->values[rank]);
+            }
+            request.enqueued = std::chrono::steady_clock::now();
+            queue.push(std::move(request));
+        }
+        queue.close();
+    });
+    while (auto request = queue.pop()){
+        context.in_flight.acquire();
+        serve_request(context, std::move(*request));
+    }
+    producer.join();
+    context.finished.wait();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t decoded = 0;
+    size_t scanned = 0;
+    for (const auto& counter : context.counters){
+        decoded += counter.decoded;
+        scanned += counter.scanned;
+    }
+    const size_t hits = context.cache.hits();
+    const size_t misses = context.cache.misses();
+    const double num_predicates = static_cast<double>(num_requests * (cdf.empty() ? 0 : options.request_size));
+
+    const auto precision = out.precision(12);
+    out << "{\n  \"requests\": " << num_requests
+        << ",\n  \"request_size\": " << options.request_size
+        << ",\n  \"threads\": " << pool.size()
+        << ",\n  \"seconds\": " << seconds
+        << ",\n  \"requests_per_s\": " << (seconds > 0.0 ? num_requests / seconds : 0.0)
+        << ",\n  \"predicates_per_s\": " << (seconds > 0.0 ? num_predicates / seconds : 0.0)
+        << ",\n  \"latency_ns\": ";
+    write_distribution(out, context.latencies);
+    out << ",\n  \"cache_hits\": " << hits
+        << ",\n  \"cache_misses\": " << misses
+        << ",\n  \"cache_hit_rate\": " << (hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0)
+        << ",\n  \"index_answers\": " << decoded
+        << ",\n  \"scans\": " << scanned
+        << ",\n  \"matches\": " << context.matches.load()
+        << "\n}" << std::endl;
+    out.precision(precision);
+}
+
+// Instrumentation mode: the load phase faults every page of the mapped files in
+constexpr size_t kPageBytes = 4096;
+
+size_t touch_pages(const MappedFile& file){
+    size_t checksum = 0;
+    for (size_t offset=0; offset < file.size(); offset += kPageBytes){
+        checksum += static_cast<unsigned char>(file.begin()[offset]);
+    }
+    return checksum;
+}
+
+// Per-call latency is sampled in a separate pass over random (query, chunk) pairs,
+// so the timed query phase and its output stay untouched by the clock reads
+constexpr size_t kLatencySamples = 1 << 16;
+
+std::vector<uint64_t> sample_query_latency(size_t num_chunks, const QueryFile* queries,
+                                           const IndexViews& indexes,
+                                           const std::vector<std::byte>& column_index){
+    std::vector<uint64_t> latencies;
+    if (num_chunks == 0 || queries->num_queries == 0){
+        return latencies;
+    }
+    std::mt19937_64 rng(1);
+    std::vector<std::optional<size_t>> counts(num_chunks);
+    size_t checksum = 0;
+    latencies.reserve(kLatencySamples);
+    for (size_t k=0; k!=kLatencySamples; k++){
+        const uint32_t predicate = queries->values[rng() % queries->num_queries];
+        const size_t j = rng() % num_chunks;
+        const auto start = std::chrono::steady_clock::now();
+        if (column_index.empty()){
+            checksum += query_idx(predicate, indexes[j]).value_or(1);
+        } else {
+            query_column_idx(predicate, column_index, counts);
+            checksum += counts[j].value_or(1);
+        }
+        const auto stop = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+    }
+    // Keeps the probes from being optimized away
+    if (checksum == 0){
+        latencies.push_back(0);
+    }
+    return latencies;
+}
+
+// One JSON document with the phases, the query latency distribution and the index sizes and kinds
+void write_instrumentation(std::ostream& out, const PhaseRecorder& recorder, std::vector<uint64_t> latencies,
+                           const IndexViews& indexes, const std::vector<std::byte>& column_index){
+    std::vector<size_t> sizes;
+    // kinds[0] counts empty indexes, kinds[1 + k] indexes of kind k
+    std::array<size_t, 1 + kKindMask + 1> kinds{};
+    if (column_index.empty()){
+        for (const auto& index : indexes){
+            sizes.push_back(index.size());
+            kinds[index.empty() ? 0 : 1 + (static_cast<uint8_t>(index[3]) & kKindMask)]++;
+        }
+    } else {
+        sizes.push_back(column_index.size());
+    }
+
+    const auto precision = out.precision(12);
+    out << "{\n  ";
+    write_phases(out, recorder);
+    out << ",\n  \"query_call\": \"" << (column_index.empty() ? "query_idx" : "query_column_idx") << "\""
+        << ",\n  \"query_ns\": ";
+    write_distribution(out, latencies);
+    out << ",\n  \"index_bytes\": ";
+    write_distribution(out, sizes);
+    out << ",\n  \"index_kinds\": {";
+    bool first = true;
+    for (size_t k=0; k!=kinds.size(); k++){
+        if (kinds[k] != 0){
+            out << (first ? "" : ", ") << "\"" << (k == 0 ? std::string("empty") : std::to_string(k - 1)) << "\": " << kinds[k];
+            first = false;
+        }
+    }
+    out << "}\n}" << std::endl;
+    out.precision(precision);
+}
+
+// A store is only reused by the same executable, on the same dataset and with the same parameters
+uint64_t fnv1a(uint64_t hash, const std::string& text){
+    for (const unsigned char c : text){
+        hash = (hash ^ c) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Size and modification time of a file, empty if it cannot be inspected
+std::string file_identity(const std::filesystem::path& path){
+    std::error_code error;
+    const auto size = std::filesystem::file_size(path, error);
+    if (error){
+        return "";
+    }
+    const auto modified = std::filesystem::last_write_time(path, error);
+    return std::to_string(size) + ":" + std::to_string(error ? 0 : modified.time_since_epoch().count());
+}
+
+uint64_t index_store_key(const char* program, const Parameters& p, const HarnessOptions& options){
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = fnv1a(hash, file_identity(program));
+    hash = fnv1a(hash, std::filesystem::absolute(p.filename + ".data").string());
+    hash = fnv1a(hash, file_identity(p.filename + ".data"));
+    hash = fnv1a(hash, std::to_string(p.f_a) + "/" + std::to_string(p.f_s));
+    if (options.global){
+        hash = fnv1a(hash, "global/" + std::to_string(options.budget_kib.value_or(0)));
+    }
+    // Indexes priced against a profile also depend on the query file
+    if (options.workload || options.queries_per_block){
+        hash = fnv1a(hash, std::to_string(options.workload) + "/" + std::to_string(options.queries_per_block.value_or(0)));
+        hash = fnv1a(hash, file_identity(p.filename + ".query"));
+    }
+    return hash;
+}
+
+// <dir>/<dataset>-<key>.idx, so stores of several datasets and parameters can share a directory
+std::string index_store_path(const std::string& dir, const Parameters& p, uint64_t key){
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(dir) / (std::filesystem::path(p.filename).filename().string() + "-" + hex + ".idx")).string();
+}
+
+void print_score(const Parameters& p, size_t num_chunks, size_t num_queries, size_t storage_bytes, size_t num_skips){
+    size_t storage_size = (storage_bytes + 1023) / 1024;
+
+    double normalizer = p.f_a * num_chunks * num_queries ;
     int64_t score = (int64_t) num_skips * (int64_t) p.f_a - (int64_t) storage_size * (int64_t) p.f_s;
 
-    std::cout << "storage size: " << storage_size << " " << storage_size * p.f_a << std::endl; 
+    std::cout << "storage size: " << storage_size << " " << storage_size * p.f_a << std::endl;
     std::cout << "num skips: " << num_skips << " " << num_skips * p.f_s << std::endl;
     std::cout << "total score:" << score * 100.0 / normalizer << std::endl;
+}
+
+int main(int argc, char** argv){
+    const auto options = argc >= 4 ? parse_options(argc, argv) : std::nullopt;
+    if (!options){
+        std::cout << "Usage: ./main <f_a> <f_s> <filename> [--threads <n>] [--batch] [--workload] [--queries-per-block <q>] [--cache <KiB>] [--column] [--inverted] [--verify] [--instrument] [--store <dir>] [--stream <depth>] [--global] [--budget <KiB>] [--service <requests>] [--request-size <k>]" << std::endl;
+        return 1;
+    }
+    verify_answers = verify_answers || options->verify;
+    // Counters are opened before any pool exists, so they follow the worker threads as well
+    std::optional<PerfCounters> counters;
+    if (options->instrument){
+        counters.emplace();
+    }
+    PhaseRecorder recorder(counters ? &*counters : nullptr);
+
+    recorder.start();
+    Parameters p(argv[1], argv[2], argv[3]);
+    MappedFile queryFile(p.filename + ".query");
+    const auto* queries = reinterpret_cast<const QueryFile*>(queryFile.begin());
+    if (options->instrument){
+        volatile size_t checksum = touch_pages(queryFile);
+        (void) checksum;
+    }
+    if (options->stream_depth){
+        recorder.stop("load", static_cast<double>(queryFile.size()), "bytes");
+
+        recorder.start();
+        p.workload = profile_workload(queries, *options);
+        set_decoded_cache_budget(options->cache_kib * 1024);
+        std::optional<ThreadPool> pool;
+        if (options->num_threads){
+            pool.emplace(*options->num_threads);
+        }
+        ChunkStream stream(p.filename + ".data", options->stream_depth);
+        std::vector<std::vector<std::byte>> built;
+        const size_t num_skips = evaluate_streaming(pool ? &*pool : nullptr, stream, p, queries, built);
+        recorder.stop("stream", static_cast<double>(stream.size() * stream.chunk_values()), "values");
+
+        size_t storage_size = 0;
+        for (const auto& index : built){
+            storage_size += index.size();
+        }
+        print_score(p, stream.size(), queries->num_queries, storage_size, num_skips);
+        if (options->instrument){
+            const IndexViews indexes(built.begin(), built.end());
+            write_instrumentation(std::cout, recorder, sample_query_latency(indexes.size(), queries, indexes, {}), indexes, {});
+        }
+        return 0;
+    }
+    MappedFile dataFile(p.filename + ".data");
+    if (options->instrument){
+        volatile size_t checksum = touch_pages(dataFile);
+        (void) checksum;
+    }
+    recorder.stop("load", static_cast<double>(dataFile.size() + queryFile.size()), "bytes");
+
+    const auto* data = reinterpret_cast<const DataFile*>(dataFile.begin());
+    const double num_values = static_cast<double>(data->num_chunks * data->chunk_size);
+    const double num_probes = static_cast<double>(data->num_chunks * queries->num_queries);
+
+    recorder.start();
+    p.workload = profile_workload(queries, *options);
+    set_decoded_cache_budget(options->cache_kib * 1024);
+
+    std::optional<ThreadPool> pool;
+    if (options->num_threads){
+        pool.emplace(*options->num_threads);
+    } else if (options->service_requests){
+        pool.emplace(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    std::vector<std::vector<std::byte>> built(data->num_chunks);
+    std::optional<IndexStore> store;
+    IndexViews indexes;
+    size_t storage_size = 0;
+    size_t num_skips = 0;
+    std::vector<std::byte> column_index;
+    if (options->column){
+        column_index = build_column_idx(column_chunks(data), p);
+    }
+    if (!column_index.empty()){
+        storage_size = column_index.size();
+    } else {
+        const uint64_t store_key = options->store_dir ? index_store_key(argv[0], p, *options) : 0;
+        const std::string store_path = options->store_dir ? index_store_path(*options->store_dir, p, store_key) : "";
+        if (options->store_dir){
+            store = IndexStore::open(store_path, store_key, data->num_chunks);
+        }
+        if (store){
+            for (size_t j=0; j!=store->size(); j++){
+                indexes.push_back((*store)[j]);
+                storage_size += indexes.back().size();
+            }
+        } else {
+            if (options->global){
+                built = build_global_idx(column_chunks(data), p, options->budget_kib ? *options->budget_kib * 1024 : SIZE_MAX);
+                for (const auto& index : built){
+                    storage_size += index.size();
+                }
+            } else {
+                storage_size = pool ? build_indexes_parallel(*pool, data, p, built) : build_indexes(data, p, built);
+            }
+            if (options->store_dir && !IndexStore::write(store_path, store_key, built)){
+                std::cerr << "Failed to write index store: " << store_path << std::endl;
+            }
+            indexes.assign(built.begin(), built.end());
+        }
+    }
+    recorder.stop("build", num_values, "values");
+
+    if (options->service_requests){
+        run_service(*pool, data, queries, indexes, *options, std::cout);
+        return 0;
+    }
+
+    recorder.start();
+    if (!column_index.empty()){
+        num_skips = evaluate_column(pool ? &*pool : nullptr, data, queries, column_index);
+    } else if (pool){
+        num_skips = options->batch ? evaluate_batch_parallel(*pool, data, queries, indexes)
+                                   : evaluate_parallel(*pool, data, queries, indexes);
+    } else {
+        num_skips = options->batch ? evaluate_batch(data, queries, indexes) : evaluate(data, queries, indexes);
+    }
+    recorder.stop("query", num_probes, "probes");
+    print_score(p, data->num_chunks, queries->num_queries, storage_size, num_skips);
+
+    if (options->inverted){
+        recorder.start();
+        const QueryPostings postings(data, queries);
+        recorder.stop("postings_build", num_values, "values");
+        recorder.start();
+        const size_t total_count = answer_from_postings(pool ? &*pool : nullptr, postings, queries, indexes);
+        recorder.stop("postings_query", static_cast<double>(queries->num_queries), "queries");
+        const auto& phases = recorder.recorded();
+        std::cout << "postings size: " << postings.size_bytes() << std::endl;
+        std::cout << "postings build ms: " << phases[phases.size() - 2].seconds * 1e3 << std::endl;
+        std::cout << "postings query ms: " << phases.back().seconds * 1e3 << " total count " << total_count << std::endl;
+    }
+
+    if (options->instrument){
+        write_instrumentation(std::cout, recorder, sample_query_latency(indexes.size(), queries, indexes, column_index), indexes, column_index);
+    }
 
-    return 0; 
+    return 0;
 }